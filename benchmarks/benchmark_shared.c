@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
@@ -42,12 +43,301 @@
 #include "shared.h"
 #include "benchmark_shared.h"
 
+char *bench_name;
+
+/*
+ * Selective completion (-Z).  The sender requests a completion on every
+ * interval'th operation, on the last operation of each window and on the
+ * last operation of the run; the rest are counted as complete when posted.
+ * An interval of -1 sweeps the powers of two up to the window size.
+ */
+static struct {
+	int interval;
+	int cur;
+	int last;
+} bw_sel;
+
+/*
+ * Adaptive iteration counts.  Each size is run as a series of rounds.  The
+ * client samples the transfer rate of every window (every iteration for
+ * ping-pong tests) and, between rounds, tells the server how many iterations
+ * the next round runs, or 0 to stop.  The run stops once the relative
+ * standard error of the sampled rate is below the target, or the time
+ * budget is spent.  Only time spent inside rounds is reported.
+ */
+#define FT_ADAPT_MIN_SAMPLES	10
+#define FT_ADAPT_ROUNDS		10
+
+static struct {
+	double budget_ns;
+	double rse;
+	uint64_t stamp;
+	uint64_t n;
+	double mean;
+	double m2;
+} adapt;
+
+static void ft_parse_adapt_opts(char *optarg)
+{
+	char *rse;
+
+	adapt.budget_ns = strtod(optarg, &rse) * 1000000000.0;
+	adapt.rse = *rse == ':' ? strtod(rse + 1, NULL) / 100.0 : 0.01;
+}
+
+static inline void adapt_start(void)
+{
+	if (adapt.budget_ns)
+		adapt.stamp = ft_timer_ticks();
+}
+
+/* Welford's running mean and variance of the window rate */
+static inline void adapt_sample(int xfers)
+{
+	uint64_t now, nsec;
+	double rate, delta;
+
+	if (!adapt.budget_ns)
+		return;
+
+	now = ft_timer_ticks();
+	nsec = ft_timer_ticks_to_ns(now - adapt.stamp);
+	if (!nsec)
+		return;
+	rate = xfers / (double) nsec;
+	adapt.stamp = now;
+
+	delta = rate - adapt.mean;
+	adapt.mean += delta / ++adapt.n;
+	adapt.m2 += delta * (rate - adapt.mean);
+}
+
+static int adapt_done(void)
+{
+	double var;
+
+	if (adapt.n < FT_ADAPT_MIN_SAMPLES)
+		return 0;
+
+	/* (stddev / sqrt(n)) / mean < rse, squared to avoid libm */
+	var = adapt.m2 / (adapt.n - 1);
+	return var / adapt.n <= adapt.rse * adapt.rse * adapt.mean * adapt.mean;
+}
+
+/*
+ * Duration runs (-D) and interval reports (-i) use the same rounds.  A
+ * duration run sizes each round to last one interval (a second without -i)
+ * and stops at the deadline.  With -i alone, the iteration count is split
+ * into rounds of about one interval.  Both sides report every interval, so
+ * throughput decay or stalls show up while the test is still running.
+ */
+static struct {
+	int64_t duration_ns;
+	int64_t interval_ns;
+} soak;
+
+static struct ft_hist run_hist, run_res_hist;
+
+static inline int bench_rounds(void)
+{
+	return adapt.budget_ns || soak.duration_ns || soak.interval_ns;
+}
+
+/* Size of the next round from the rate of the last one; 0 ends the run */
+static int round_next(int iters, int total, int64_t round_ns, int64_t total_ns)
+{
+	int64_t target;
+	int unit = (opts.options & FT_OPT_BW) ? opts.window_size : 1;
+	int left = INT32_MAX;
+
+	if (soak.duration_ns) {
+		if (total_ns >= soak.duration_ns)
+			return 0;
+		target = MIN(soak.interval_ns ? soak.interval_ns : 1000000000,
+			     soak.duration_ns - total_ns);
+	} else if (adapt.budget_ns) {
+		if (total_ns >= adapt.budget_ns || adapt_done())
+			return 0;
+		target = MIN(adapt.budget_ns / FT_ADAPT_ROUNDS,
+			     adapt.budget_ns - total_ns);
+		if (soak.interval_ns)
+			target = MIN(target, soak.interval_ns);
+	} else {
+		left = opts.iterations - total;
+		if (left <= 0)
+			return 0;
+		target = soak.interval_ns;
+	}
+
+	if (round_ns > 0)
+		iters = (int) MIN((double) iters * target / round_ns, INT32_MAX / 2);
+
+	/* keep rounds a whole number of windows */
+	iters = MAX((iters + unit - 1) / unit * unit, unit);
+	return MIN(iters, left);
+}
+
+/* The client sends the next round's iteration count; 0 ends the run. */
+static int adapt_xchg(int *iters)
+{
+	int ret;
+
+	if (opts.dst_addr) {
+		*(int *) (tx_buf + ft_tx_prefix_size()) = *iters;
+		ret = ft_tx(ep, remote_fi_addr, sizeof *iters, &tx_ctx);
+		if (ret)
+			return ret;
+
+		ret = ft_rx(ep, 1);
+	} else {
+		ret = ft_rx(ep, sizeof *iters);
+		if (ret)
+			return ret;
+
+		/* read before replying, the client sends nothing until then */
+		*iters = *(int *) (rx_buf + ft_rx_prefix_size());
+		ret = ft_tx(ep, remote_fi_addr, 1, &tx_ctx);
+	}
+
+	return ret;
+}
+
+static void bench_show_perf(char *name, int iters, int xfers_per_iter)
+{
+	struct ft_perf_rec rec;
+
+	ft_perf_init_rec(&rec, name ? name : bench_name, opts.transfer_size,
+			 iters, &start, &end, xfers_per_iter);
+	ft_perf_write(opts.machr && opts.perf_fmt == FT_PERF_TEXT ?
+		      FT_PERF_YAML : opts.perf_fmt, &rec);
+}
+
+/* Only time spent inside rounds counts, so end is rebuilt from start */
+static void bench_set_span(const struct timespec *first, int64_t nsec)
+{
+	start = *first;
+	end.tv_sec = first->tv_sec + (first->tv_nsec + nsec) / 1000000000;
+	end.tv_nsec = (first->tv_nsec + nsec) % 1000000000;
+}
+
+/*
+ * Report the rounds accumulated since the last interval report.  The
+ * interval's latency samples are then folded into run_hist, which becomes
+ * lat_hist again for the final report, and likewise for residency.
+ */
+static void round_report(int iters, int64_t from_ns, int64_t nsec,
+			 int xfers_per_iter)
+{
+	char name[32];
+
+	snprintf(name, sizeof name, "%.2f-%.2f sec", from_ns / 1e9,
+		 (from_ns + nsec) / 1e9);
+	bench_set_span(&start, nsec);
+	bench_show_perf(name, iters, xfers_per_iter);
+
+	if (opts.options & FT_OPT_LAT_HIST) {
+		ft_hist_merge(&run_hist, &lat_hist);
+		ft_hist_reset(&lat_hist);
+	}
+	if (opts.options & FT_OPT_RESIDENCY) {
+		ft_hist_merge(&run_res_hist, &res_hist);
+		ft_hist_reset(&res_hist);
+	}
+}
+
+static int round_run(int (*loop)(int iters, int warmup), int xfers_per_iter)
+{
+	struct timespec first, ival_start;
+	int64_t round_ns, total_ns = 0, ival_ns = 0;
+	int iters, total = 0, ival_iters = 0, warmup = opts.warmup_iterations;
+	int ret;
+
+	adapt.n = 0;
+	adapt.mean = adapt.m2 = 0;
+	ft_hist_reset(&run_hist);
+	ft_hist_reset(&run_res_hist);
+	iters = (opts.options & FT_OPT_BW) ? opts.window_size : 1;
+
+	while (1) {
+		ret = adapt_xchg(&iters);
+		if (ret)
+			return ret;
+		if (!iters)
+			break;
+
+		ret = loop(iters, warmup);
+		if (ret)
+			return ret;
+
+		if (!total)
+			first = start;
+		if (!ival_iters)
+			ival_start = start;
+		round_ns = get_elapsed(&start, &end, NANO);
+		total_ns += round_ns;
+		total += iters;
+		ival_ns += round_ns;
+		ival_iters += iters;
+		warmup = 0;
+
+		/* short calibration rounds are merged into the next interval */
+		if (soak.interval_ns && ival_ns >= soak.interval_ns / 2) {
+			start = ival_start;
+			round_report(ival_iters, total_ns - ival_ns, ival_ns,
+				     xfers_per_iter);
+			ival_ns = ival_iters = 0;
+		}
+
+		if (opts.dst_addr)
+			iters = round_next(iters, total, round_ns, total_ns);
+	}
+
+	if (soak.interval_ns) {
+		if (ival_iters) {
+			start = ival_start;
+			round_report(ival_iters, total_ns - ival_ns, ival_ns,
+				     xfers_per_iter);
+		}
+		if (opts.options & FT_OPT_LAT_HIST)
+			lat_hist = run_hist;
+		if (opts.options & FT_OPT_RESIDENCY)
+			res_hist = run_res_hist;
+	}
+
+	bench_set_span(&first, total_ns);
+	bench_show_perf(soak.interval_ns ? "total" : NULL, total,
+			xfers_per_iter);
+	return 0;
+}
+
+static int bench_run(int (*loop)(int iters, int warmup), int xfers_per_iter)
+{
+	int ret;
+
+	if (bench_rounds())
+		return round_run(loop, xfers_per_iter);
+
+	ret = loop(opts.iterations, opts.warmup_iterations);
+	if (ret)
+		return ret;
+
+	bench_show_perf(NULL, opts.iterations, xfers_per_iter);
+	return 0;
+}
+
 void ft_parse_benchmark_opts(int op, char *optarg)
 {
 	switch (op) {
 	case 'v':
 		opts.options |= FT_OPT_VERIFY_DATA;
 		break;
+	case 'V':
+		if (!strncasecmp("thread", optarg, 6))
+			opts.verify_mode = FT_VERIFY_CSUM_THREAD;
+		else
+			opts.verify_mode = FT_VERIFY_CSUM;
+		opts.options |= FT_OPT_VERIFY_DATA;
+		break;
 	case 'k':
 		hints->mode |= FI_MSG_PREFIX;
 		break;
@@ -57,6 +347,38 @@ void ft_parse_benchmark_opts(int op, char *optarg)
 	case 'W':
 		opts.window_size = atoi(optarg);
 		break;
+	case 'H':
+		opts.options |= FT_OPT_LAT_HIST;
+		break;
+	case 'b':
+		opts.comp_batch = atoi(optarg);
+		break;
+	case 'A':
+		ft_parse_adapt_opts(optarg);
+		break;
+	case 'u':
+		opts.options |= FT_OPT_POOL;
+		break;
+	case 'Q':
+		opts.options |= FT_OPT_STREAM;
+		break;
+	case 'R':
+		opts.options |= FT_OPT_RESIDENCY;
+		break;
+	case 'Z':
+		bw_sel.interval = strncasecmp(optarg, "all", 3) ?
+				  atoi(optarg) : -1;
+		if (!bw_sel.interval)
+			break;
+		opts.options |= FT_OPT_SELECTIVE;
+		hints->tx_attr->op_flags |= FI_COMPLETION;
+		break;
+	case 'D':
+		soak.duration_ns = strtod(optarg, NULL) * 1000000000.0;
+		break;
+	case 'i':
+		soak.interval_ns = strtod(optarg, NULL) * 1000000000.0;
+		break;
 	default:
 		break;
 	}
@@ -65,166 +387,1110 @@ void ft_parse_benchmark_opts(int op, char *optarg)
 void ft_benchmark_usage(void)
 {
 	FT_PRINT_OPTS_USAGE("-v", "enables data_integrity checks");
+	FT_PRINT_OPTS_USAGE("-V <inline|thread>", "verify a sequence number and "
+			"CRC32C stamped in each message, inline or on a "
+			"verifier thread");
 	FT_PRINT_OPTS_USAGE("-k", "enable prefix mode");
 	FT_PRINT_OPTS_USAGE("-j", "maximum inject message size");
 	FT_PRINT_OPTS_USAGE("-W", "window size* (for bandwidth tests)\n\n"
 			"* The following condition is required to have at least "
 			"one window\nsize # of messsages to be sent: "
 			"# of iterations > window size");
+	FT_PRINT_OPTS_USAGE("-H", "report latency percentiles and jitter "
+			"(for pingpong tests)");
+	FT_PRINT_OPTS_USAGE("-b <count>", "max completions reaped per CQ read "
+			"(default: 16, max: 64)");
+	FT_PRINT_OPTS_USAGE("-A <sec>[:<rse%>]", "adaptive iteration count: run "
+			"each size until the relative standard error of the "
+			"rate drops below rse% (default: 1) or sec expires");
+	FT_PRINT_OPTS_USAGE("-u", "use a separate buffer slot per window entry "
+			"(for bandwidth tests)");
+	FT_PRINT_OPTS_USAGE("-Q", "stream: keep window size ops in flight, with "
+			"credit based flow control (for bandwidth tests)");
+	FT_PRINT_OPTS_USAGE("-R", "report the time each operation spends between "
+			"post and completion (for bandwidth tests)");
+	FT_PRINT_OPTS_USAGE("-Z <n|all>", "selective completion: request a "
+			"completion on every nth op and the last op of each "
+			"window, or sweep n up to the window size (for "
+			"bandwidth tests)");
+	FT_PRINT_OPTS_USAGE("-D <sec>", "run each size for sec seconds "
+			"instead of a fixed iteration count");
+	FT_PRINT_OPTS_USAGE("-i <sec>", "report throughput and latency every "
+			"sec seconds");
+}
+
+int ft_bw_init(void)
+{
+	if (opts.window_size > 0) {
+		tx_ctx_arr = calloc(opts.window_size, sizeof(struct fi_context));
+		if (!tx_ctx_arr)
+			return -FI_ENOMEM;
+	}
+	if (opts.options & (FT_OPT_POOL | FT_OPT_STREAM)) {
+		rx_ctx_arr = calloc(2, sizeof(struct fi_context));
+		if (!rx_ctx_arr)
+			return -FI_ENOMEM;
+	}
+	if ((opts.options & (FT_OPT_RESIDENCY | FT_OPT_STREAM)) &&
+	    opts.window_size > 0)
+		return ft_op_pool_alloc(opts.window_size);
+	return 0;
+}
+
+/*
+ * Per-iteration timestamping for the latency histogram.  Each iteration is
+ * charged the time since the previous one, so only a single clock read is
+ * taken per round trip.
+ */
+static uint64_t lat_stamp;
+
+static inline void pingpong_start(int i, int warmup)
+{
+	if (i != warmup)
+		return;
+
+	ft_start();
+	adapt_start();
+	if (opts.options & FT_OPT_LAT_HIST)
+		lat_stamp = ft_timer_ticks();
+}
+
+static inline void pingpong_stamp(int i, int warmup)
+{
+	uint64_t now;
+
+	if (i < warmup)
+		return;
+
+	adapt_sample(1);
+	if (!(opts.options & FT_OPT_LAT_HIST))
+		return;
+
+	now = ft_timer_ticks();
+	ft_hist_add(&lat_hist, ft_timer_ticks_to_ns(now - lat_stamp));
+	lat_stamp = now;
+}
+
+/*
+ * Specialized loops.  The generic loops below go through ft_tx(), ft_rx()
+ * and friends, which test the capabilities, the operation and the
+ * completion method on every call.  The kernels here are written against
+ * constant op and comp arguments and instantiated per combination by
+ * BENCH_KERNELS, so the compiler folds those tests away, and
+ * bench_kernel() picks an instance before the timed loop starts.  A kernel runs on the default context.
+ * With -v and -R the generic loops are used.
+ */
+enum bench_op {
+	BENCH_OP_SEND,
+	BENCH_OP_TSEND,
+	BENCH_OP_INJECT,
+	BENCH_OP_TINJECT,
+	BENCH_OP_WRITE,
+	BENCH_OP_WRITEDATA,
+	BENCH_OP_READ,
+	BENCH_OP_INJECT_WRITE,
+	BENCH_OP_INJECT_WRITEDATA,
+	BENCH_OP_CNT
+};
+
+/* Spin on CQs, wait on CQs as opts.comp_method says, or wait on counters */
+enum bench_comp {
+	BENCH_COMP_SPIN,
+	BENCH_COMP_WAIT,
+	BENCH_COMP_CNTR,
+	BENCH_COMP_CNT
+};
+
+typedef int (*bench_loop_fn)(int iters, int warmup);
+
+#define BENCH_INLINE static inline __attribute__((always_inline))
+
+static enum ft_rma_opcodes bw_rma_op;
+static struct fi_rma_iov *bw_rma_remote;
+
+BENCH_INLINE int bench_op_rma(const enum bench_op op)
+{
+	return op >= BENCH_OP_WRITE;
+}
+
+BENCH_INLINE int bench_op_inject(const enum bench_op op)
+{
+	return op == BENCH_OP_INJECT || op == BENCH_OP_TINJECT ||
+	       op == BENCH_OP_INJECT_WRITE || op == BENCH_OP_INJECT_WRITEDATA;
+}
+
+BENCH_INLINE int bench_cq_spin(struct fid_cq *cq, uint64_t *cur,
+			       uint64_t total)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	uint64_t batch = ft_comp_batch();
+	ssize_t ret;
+
+	while (*cur < total) {
+		ret = fi_cq_read(cq, comp, MIN(total - *cur, batch));
+		if (ret > 0) {
+			*cur += ret;
+		} else if (ret == -FI_EAVAIL) {
+			(*cur)++;
+			return ft_cq_readerr(cq);
+		} else if (ret != -FI_EAGAIN) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+BENCH_INLINE int bench_cntr_wait(struct fid_cntr *cntr, uint64_t total)
+{
+	int ret;
+
+	if (fi_cntr_read(cntr) >= total)
+		return 0;
+
+	ret = fi_cntr_wait(cntr, total, -1);
+	if (ret)
+		FT_PRINTERR("fi_cntr_wait", ret);
+	return ret;
+}
+
+BENCH_INLINE int bench_tx_wait(struct ft_ctx *c, uint64_t total,
+			       const enum bench_comp comp)
+{
+	switch (comp) {
+	case BENCH_COMP_SPIN:
+		return bench_cq_spin(c->tx_cq, &c->tx_completed, total);
+	case BENCH_COMP_CNTR:
+		return bench_cntr_wait(c->tx_cntr, total);
+	default:
+		return ft_ctx_get_tx_comp(c, total);
+	}
+}
+
+BENCH_INLINE int bench_rx_wait(struct ft_ctx *c, uint64_t total,
+			       const enum bench_comp comp)
+{
+	switch (comp) {
+	case BENCH_COMP_SPIN:
+		return bench_cq_spin(c->rx_cq, &c->rx_completed, total);
+	case BENCH_COMP_CNTR:
+		return bench_cntr_wait(c->rx_cntr, total);
+	default:
+		return ft_ctx_get_rx_comp(c, total);
+	}
+}
+
+BENCH_INLINE ssize_t bench_post(struct ft_ctx *c, void *buf, size_t len,
+				void *desc, void *ctx, const enum bench_op op)
+{
+	struct fi_rma_iov *rma = bw_rma_remote;
+
+	switch (op) {
+	case BENCH_OP_SEND:
+		return fi_send(c->ep, buf, len, desc, c->peer_addr, ctx);
+	case BENCH_OP_TSEND:
+		return fi_tsend(c->ep, buf, len, desc, c->peer_addr,
+				c->tx_posted, ctx);
+	case BENCH_OP_INJECT:
+		return fi_inject(c->ep, buf, len, c->peer_addr);
+	case BENCH_OP_TINJECT:
+		return fi_tinject(c->ep, buf, len, c->peer_addr,
+				  c->tx_posted);
+	case BENCH_OP_WRITE:
+		return fi_write(c->ep, buf, len, desc, c->peer_addr,
+				rma->addr, rma->key, ctx);
+	case BENCH_OP_WRITEDATA:
+		return fi_writedata(c->ep, buf, len, desc, remote_cq_data,
+				    c->peer_addr, rma->addr, rma->key,
+				    ctx);
+	case BENCH_OP_READ:
+		return fi_read(c->ep, buf, len, desc, c->peer_addr,
+			       rma->addr, rma->key, ctx);
+	case BENCH_OP_INJECT_WRITE:
+		return fi_inject_write(c->ep, buf, len, c->peer_addr,
+				       rma->addr, rma->key);
+	default:
+		return fi_inject_writedata(c->ep, buf, len, remote_cq_data,
+					   c->peer_addr, rma->addr,
+					   rma->key);
+	}
+}
+
+/* Post a transmit, reaping completions while the provider says EAGAIN */
+BENCH_INLINE int bench_tx(struct ft_ctx *c, void *buf, size_t len,
+			  void *desc, void *ctx, const enum bench_op op,
+			  const enum bench_comp comp)
+{
+	ssize_t ret;
+
+	while ((ret = bench_post(c, buf, len, desc, ctx, op)) == -FI_EAGAIN) {
+		ret = bench_tx_wait(c, c->tx_posted, comp);
+		if (ret)
+			return ret;
+	}
+	if (ret) {
+		FT_PRINTERR("transmit", ret);
+		return ret;
+	}
+
+	c->tx_posted++;
+	if (bench_op_inject(op))
+		c->tx_completed++;
+	return 0;
+}
+
+/* Receives are tagged for BENCH_OP_TSEND, EAGAIN takes the generic path */
+BENCH_INLINE int bench_post_rx(struct ft_ctx *c, void *buf, size_t len,
+			       size_t size, void *desc, void *ctx,
+			       const enum bench_op op)
+{
+	ssize_t ret;
+
+	if (op == BENCH_OP_TSEND)
+		ret = fi_trecv(c->ep, buf, len, desc, 0, c->rx_posted, 0, ctx);
+	else
+		ret = fi_recv(c->ep, buf, len, desc, 0, ctx);
+
+	if (ret == -FI_EAGAIN)
+		return ft_ctx_post_rx_buf(c, size, ctx, buf);
+	if (ret) {
+		FT_PRINTERR("receive", ret);
+		return ret;
+	}
+
+	c->rx_posted++;
+	return 0;
+}
+
+BENCH_INLINE int pingpong_kernel_tx(struct ft_ctx *c, size_t len, void *desc,
+				    const enum bench_op op,
+				    const enum bench_comp comp)
+{
+	int ret;
+
+	ret = bench_tx(c, c->tx_msg, len, desc, &tx_ctx, op, comp);
+	if (ret || bench_op_inject(op))
+		return ret;
+
+	return bench_tx_wait(c, c->tx_posted, comp);
+}
+
+BENCH_INLINE int pingpong_kernel_rx(struct ft_ctx *c, size_t len, void *desc,
+				    const enum bench_op op,
+				    const enum bench_comp comp)
+{
+	int ret;
+
+	ret = bench_rx_wait(c, c->rx_posted, comp);
+	if (ret)
+		return ret;
+
+	return bench_post_rx(c, c->rx_msg, len, c->rx_msg_size, desc, &c->rx_ctx,
+			     op == BENCH_OP_TINJECT ? BENCH_OP_TSEND : op);
+}
+
+BENCH_INLINE int pingpong_kernel(struct ft_ctx *c, int iters, int warmup,
+				 const enum bench_op op,
+				 const enum bench_comp comp)
+{
+	size_t tx_len = opts.transfer_size + ft_tx_prefix_size();
+	size_t rx_len = MAX(c->rx_msg_size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size();
+	void *desc = fi_mr_desc(c->mr);
+	int ret, i;
+
+	if (opts.dst_addr) {
+		for (i = 0; i < iters + warmup; i++) {
+			pingpong_start(i, warmup);
+
+			ret = pingpong_kernel_tx(c, tx_len, desc, op, comp);
+			if (ret)
+				return ret;
+
+			ret = pingpong_kernel_rx(c, rx_len, desc, op, comp);
+			if (ret)
+				return ret;
+
+			pingpong_stamp(i, warmup);
+		}
+	} else {
+		for (i = 0; i < iters + warmup; i++) {
+			pingpong_start(i, warmup);
+
+			ret = pingpong_kernel_rx(c, rx_len, desc, op, comp);
+			if (ret)
+				return ret;
+
+			ret = pingpong_kernel_tx(c, tx_len, desc, op, comp);
+			if (ret)
+				return ret;
+
+			pingpong_stamp(i, warmup);
+		}
+	}
+	ft_stop();
+
+	return 0;
+}
+
+/*
+ * Window bandwidth, initiator side, for messages and RMA.  Messages and
+ * writedata are acked by the peer at the end of each window, see
+ * bw_tx_comp().
+ */
+BENCH_INLINE int bw_tx_kernel_comp(struct ft_ctx *c, const enum bench_op op,
+				   const enum bench_comp comp)
+{
+	int ret;
+
+	ret = bench_tx_wait(c, c->tx_posted, comp);
+	if (ret || op == BENCH_OP_WRITE || op == BENCH_OP_INJECT_WRITE ||
+	    op == BENCH_OP_READ)
+		return ret;
+
+	return ft_ctx_rx(c, 4);
+}
+
+BENCH_INLINE int bw_tx_kernel(struct ft_ctx *c, int iters, int warmup,
+			      const enum bench_op op,
+			      const enum bench_comp comp)
+{
+	size_t len = opts.transfer_size;
+	void *desc = fi_mr_desc(c->mr);
+	void *buf;
+	int ret, i, j;
+
+	if (!bench_op_rma(op))
+		len += ft_tx_prefix_size();
+
+	for (i = j = 0; i < iters + warmup; i++) {
+		if (i == warmup) {
+			ft_start();
+			adapt_start();
+		}
+
+		buf = op == BENCH_OP_READ ? ft_rx_slot(j) : ft_tx_slot(j);
+		ret = bench_tx(c, buf, len, desc, &tx_ctx_arr[j], op, comp);
+		if (ret)
+			return ret;
+
+		if (++j == opts.window_size) {
+			ret = bw_tx_kernel_comp(c, op, comp);
+			if (ret)
+				return ret;
+			j = 0;
+			if (i >= warmup)
+				adapt_sample(opts.window_size);
+		}
+	}
+	ret = bw_tx_kernel_comp(c, op, comp);
+	if (ret)
+		return ret;
+	ft_stop();
+
+	return 0;
+}
+
+/*
+ * Window bandwidth, receiving side, with the buffer placement of
+ * bw_post_rx().  BENCH_OP_WRITEDATA receives the remote CQ data of writes.
+ */
+BENCH_INLINE int bw_rx_kernel_comp(struct ft_ctx *c, const enum bench_comp comp)
+{
+	int ret;
+
+	/* rx_seq is always one ahead */
+	ret = bench_rx_wait(c, c->rx_posted - 1, comp);
+	if (ret)
+		return ret;
+	return ft_ctx_tx(c, c->peer_addr, 4, &tx_ctx);
+}
+
+BENCH_INLINE int bw_rx_kernel(struct ft_ctx *c, int iters, int warmup,
+			      const enum bench_op op,
+			      const enum bench_comp comp)
+{
+	size_t size = op == BENCH_OP_WRITEDATA ? 0 : opts.transfer_size;
+	size_t len = MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size();
+	void *desc = fi_mr_desc(c->mr);
+	int last = iters + warmup - 1;
+	struct fi_context *ctx;
+	void *buf;
+	int ret, i, j;
+
+	for (i = j = 0; i < iters + warmup; i++) {
+		if (i == warmup)
+			ft_start();
+
+		if (!ft_pool.slot_cnt) {
+			buf = c->rx_msg;
+			ctx = &tx_ctx_arr[j];
+		} else if (j == opts.window_size - 1 || i == last) {
+			buf = c->rx_msg;
+			ctx = &rx_ctx_arr[(i / opts.window_size) & 1];
+		} else {
+			buf = ft_rx_slot(j);
+			ctx = &tx_ctx_arr[j];
+		}
+
+		ret = bench_post_rx(c, buf, len, size, desc, ctx, op);
+		if (ret)
+			return ret;
+
+		if (++j == opts.window_size) {
+			ret = bw_rx_kernel_comp(c, comp);
+			if (ret)
+				return ret;
+			j = 0;
+		}
+	}
+	ret = bw_rx_kernel_comp(c, comp);
+	if (ret)
+		return ret;
+	ft_stop();
+
+	return 0;
+}
+
+#define BENCH_KERNEL(kern, op, comp)					\
+static int kern##_##op##_##comp(int iters, int warmup)			\
+{									\
+	return kern(ft_ctx_default(ep), iters, warmup, BENCH_OP_##op,	\
+		    BENCH_COMP_##comp);					\
+}
+
+#define BENCH_KERNELS(kern, op)						\
+	BENCH_KERNEL(kern, op, SPIN)					\
+	BENCH_KERNEL(kern, op, WAIT)					\
+	BENCH_KERNEL(kern, op, CNTR)
+
+#define BENCH_KERNEL_ROW(kern, op)					\
+	[BENCH_OP_##op] = {						\
+		[BENCH_COMP_SPIN] = kern##_##op##_SPIN,			\
+		[BENCH_COMP_WAIT] = kern##_##op##_WAIT,			\
+		[BENCH_COMP_CNTR] = kern##_##op##_CNTR,			\
+	}
+
+BENCH_KERNELS(pingpong_kernel, SEND)
+BENCH_KERNELS(pingpong_kernel, TSEND)
+BENCH_KERNELS(pingpong_kernel, INJECT)
+BENCH_KERNELS(pingpong_kernel, TINJECT)
+
+static const bench_loop_fn pingpong_kernels[BENCH_OP_CNT][BENCH_COMP_CNT] = {
+	BENCH_KERNEL_ROW(pingpong_kernel, SEND),
+	BENCH_KERNEL_ROW(pingpong_kernel, TSEND),
+	BENCH_KERNEL_ROW(pingpong_kernel, INJECT),
+	BENCH_KERNEL_ROW(pingpong_kernel, TINJECT),
+};
+
+BENCH_KERNELS(bw_tx_kernel, SEND)
+BENCH_KERNELS(bw_tx_kernel, TSEND)
+BENCH_KERNELS(bw_tx_kernel, INJECT)
+BENCH_KERNELS(bw_tx_kernel, TINJECT)
+BENCH_KERNELS(bw_tx_kernel, WRITE)
+BENCH_KERNELS(bw_tx_kernel, WRITEDATA)
+BENCH_KERNELS(bw_tx_kernel, READ)
+BENCH_KERNELS(bw_tx_kernel, INJECT_WRITE)
+BENCH_KERNELS(bw_tx_kernel, INJECT_WRITEDATA)
+
+static const bench_loop_fn bw_tx_kernels[BENCH_OP_CNT][BENCH_COMP_CNT] = {
+	BENCH_KERNEL_ROW(bw_tx_kernel, SEND),
+	BENCH_KERNEL_ROW(bw_tx_kernel, TSEND),
+	BENCH_KERNEL_ROW(bw_tx_kernel, INJECT),
+	BENCH_KERNEL_ROW(bw_tx_kernel, TINJECT),
+	BENCH_KERNEL_ROW(bw_tx_kernel, WRITE),
+	BENCH_KERNEL_ROW(bw_tx_kernel, WRITEDATA),
+	BENCH_KERNEL_ROW(bw_tx_kernel, READ),
+	BENCH_KERNEL_ROW(bw_tx_kernel, INJECT_WRITE),
+	BENCH_KERNEL_ROW(bw_tx_kernel, INJECT_WRITEDATA),
+};
+
+BENCH_KERNELS(bw_rx_kernel, SEND)
+BENCH_KERNELS(bw_rx_kernel, TSEND)
+BENCH_KERNELS(bw_rx_kernel, WRITEDATA)
+
+static const bench_loop_fn bw_rx_kernels[BENCH_OP_CNT][BENCH_COMP_CNT] = {
+	BENCH_KERNEL_ROW(bw_rx_kernel, SEND),
+	BENCH_KERNEL_ROW(bw_rx_kernel, TSEND),
+	BENCH_KERNEL_ROW(bw_rx_kernel, WRITEDATA),
+};
+
+/*
+ * The inline spin and counter waits have no timeout, so a receive timeout
+ * (-T) takes the generic wait, as do mixed CQ and counter setups.
+ */
+static bench_loop_fn bench_kernel(const bench_loop_fn table[][BENCH_COMP_CNT],
+				  enum bench_op op, bench_loop_fn generic)
+{
+	enum bench_comp comp = BENCH_COMP_WAIT;
+
+	if (op == BENCH_OP_CNT ||
+	    (opts.options & (FT_OPT_VERIFY_DATA | FT_OPT_RESIDENCY |
+			     FT_OPT_SELECTIVE)))
+		return generic;
+
+	if (timeout < 0 && txcq && rxcq && opts.comp_method == FT_COMP_SPIN)
+		comp = BENCH_COMP_SPIN;
+	else if (timeout < 0 && !txcq && !rxcq && txcntr && rxcntr)
+		comp = BENCH_COMP_CNTR;
+
+	return table[op][comp] ? table[op][comp] : generic;
+}
+
+static enum bench_op bench_msg_op(void)
+{
+	int tagged = hints->caps & FI_TAGGED;
+
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		return tagged ? BENCH_OP_TINJECT : BENCH_OP_INJECT;
+	return tagged ? BENCH_OP_TSEND : BENCH_OP_SEND;
 }
 
-int ft_bw_init(void)
+static enum bench_op bench_rma_op(enum ft_rma_opcodes rma_op)
+{
+	int inject = opts.transfer_size < fi->tx_attr->inject_size;
+
+	switch (rma_op) {
+	case FT_RMA_WRITE:
+		return inject ? BENCH_OP_INJECT_WRITE : BENCH_OP_WRITE;
+	case FT_RMA_WRITEDATA:
+		return inject ? BENCH_OP_INJECT_WRITEDATA : BENCH_OP_WRITEDATA;
+	case FT_RMA_READ:
+		return BENCH_OP_READ;
+	default:
+		return BENCH_OP_CNT;
+	}
+}
+
+static int pingpong_loop(int iters, int warmup)
+{
+	int ret, i;
+
+	if (opts.dst_addr) {
+		for (i = 0; i < iters + warmup; i++) {
+			pingpong_start(i, warmup);
+
+			if (opts.transfer_size < fi->tx_attr->inject_size)
+				ret = ft_inject(ep, opts.transfer_size);
+			else
+				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size, &tx_ctx);
+			if (ret)
+				return ret;
+
+			ret = ft_rx(ep, opts.transfer_size);
+			if (ret)
+				return ret;
+
+			pingpong_stamp(i, warmup);
+		}
+	} else {
+		for (i = 0; i < iters + warmup; i++) {
+			pingpong_start(i, warmup);
+
+			ret = ft_rx(ep, opts.transfer_size);
+			if (ret)
+				return ret;
+
+			if (opts.transfer_size < fi->tx_attr->inject_size)
+				ret = ft_inject(ep, opts.transfer_size);
+			else
+				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size, &tx_ctx);
+			if (ret)
+				return ret;
+
+			pingpong_stamp(i, warmup);
+		}
+	}
+	ft_stop();
+
+	return 0;
+}
+
+int pingpong(void)
+{
+	int ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.options & FT_OPT_LAT_HIST)
+		ft_hist_reset(&lat_hist);
+
+	return bench_run(bench_kernel(pingpong_kernels, bench_msg_op(),
+				      pingpong_loop), 2);
+}
+
+static int bw_tx_comp()
+{
+	int ret;
+
+	ret = ft_get_tx_comp(tx_seq);
+	if (ret)
+		return ret;
+	return ft_rx(ep, 4);
+}
+
+static int bw_rx_comp()
+{
+	int ret;
+
+	/* rx_seq is always one ahead */
+	ret = ft_get_rx_comp(rx_seq - 1);
+	if (ret)
+		return ret;
+	return ft_tx(ep, remote_fi_addr, 4, &tx_ctx);
+}
+
+/*
+ * With a slot per window entry each message lands in its own buffer, so
+ * data can be verified.  Only iterations past the warmup are filled.
+ */
+static inline int bw_verify(int i, int warmup)
+{
+	return (opts.options & (FT_OPT_POOL | FT_OPT_VERIFY_DATA)) ==
+	       (FT_OPT_POOL | FT_OPT_VERIFY_DATA) && i >= warmup;
+}
+
+/*
+ * The receive posted last in a window stays outstanding across the ack
+ * (rx_seq is always one ahead) and takes the first message of the next
+ * window.  With a slot pool that receive always targets rx_buf, alternating
+ * between two contexts, so that control messages exchanged after the loop
+ * still land in rx_buf.  Message k > 0 of a window thus lands in slot k - 1.
+ */
+static int bw_post_rx(size_t size, int i, int j, int last)
+{
+	if (!ft_pool.slot_cnt)
+		return ft_post_rx(ep, size, &tx_ctx_arr[j]);
+
+	if (j == opts.window_size - 1 || i == last)
+		return ft_post_rx_buf(ep, size,
+				&rx_ctx_arr[(i / opts.window_size) & 1], rx_buf);
+
+	return ft_post_rx_buf(ep, size, &tx_ctx_arr[j], ft_rx_slot(j));
+}
+
+/* Check the cnt messages of a completed window, starting at iteration i */
+static int bw_check_slots(int i, int cnt, int warmup)
+{
+	char *buf;
+	int k;
+
+	for (k = 0; k < cnt; k++) {
+		if (!bw_verify(i + k, warmup))
+			continue;
+		buf = k ? ft_rx_slot(k - 1) : rx_buf;
+		if (ft_check_buf(buf + ft_rx_prefix_size(), opts.transfer_size))
+			return -FI_EIO;
+	}
+	return 0;
+}
+
+/* With -R or -Q, window entry j is posted with a context stamped now */
+static inline struct fi_context *bw_tx_ctx(int j)
+{
+	if (!ft_op_pool.cnt)
+		return &tx_ctx_arr[j];
+
+	ft_op_pool.op[j].post_tick = ft_timer_ticks();
+	ft_op_pool.op[j].done = 0;
+	return &ft_op_pool.op[j].ctx;
+}
+
+static inline uint64_t bw_sel_flags(int i, int j)
+{
+	uint64_t flags = 0;
+
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		flags |= FI_INJECT;
+	if (j == opts.window_size - 1 || i == bw_sel.last ||
+	    (i + 1) % bw_sel.cur == 0)
+		flags |= FI_COMPLETION;
+	return flags;
+}
+
+static int bw_post_msg(int i, int j, int warmup)
+{
+	if (bw_verify(i, warmup))
+		ft_fill_buf((char *) ft_tx_slot(j) + ft_tx_prefix_size(),
+			    opts.transfer_size);
+
+	if (bw_sel.interval)
+		return ft_post_tx_flags(ep, remote_fi_addr, opts.transfer_size,
+					bw_tx_ctx(j), ft_tx_slot(j),
+					bw_sel_flags(i, j));
+
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		return ft_post_inject_buf(ep, opts.transfer_size, ft_tx_slot(j));
+
+	return ft_post_tx_buf(ep, remote_fi_addr, opts.transfer_size,
+			      bw_tx_ctx(j), ft_tx_slot(j));
+}
+
+static int bandwidth_loop(int iters, int warmup)
+{
+	int ret, i, j;
+
+	/* The loop structured allows for the possibility that the sender
+	 * immediately overruns the receiving side on the first transfer (or
+	 * the entire window). This could result in exercising parts of the
+	 * provider's implementation of FI_RM_ENABLED. For better or worse,
+	 * some MPI-level benchmarks tend to use this type of loop for measuring
+	 * bandwidth.  */
+
+	if (opts.dst_addr) {
+		bw_sel.last = iters + warmup - 1;
+		for (i = j = 0; i < iters + warmup; i++) {
+			if (i == warmup) {
+				ft_start();
+				adapt_start();
+			}
+
+			ret = bw_post_msg(i, j, warmup);
+			if (ret)
+				return ret;
+
+			if (++j == opts.window_size) {
+				ret = bw_tx_comp();
+				if (ret)
+					return ret;
+				j = 0;
+				if (i >= warmup)
+					adapt_sample(opts.window_size);
+			}
+		}
+		ret = bw_tx_comp();
+		if (ret)
+			return ret;
+	} else {
+		for (i = j = 0; i < iters + warmup; i++) {
+			if (i == warmup)
+				ft_start();
+
+			ret = bw_post_rx(opts.transfer_size, i, j,
+					 iters + warmup - 1);
+			if (ret)
+				return ret;
+
+			if (++j == opts.window_size) {
+				ret = bw_rx_comp();
+				if (ret)
+					return ret;
+				ret = bw_check_slots(i + 1 - j, j, warmup);
+				if (ret)
+					return ret;
+				j = 0;
+			}
+		}
+		ret = bw_rx_comp();
+		if (ret)
+			return ret;
+		ret = bw_check_slots(i - j, j, warmup);
+		if (ret)
+			return ret;
+	}
+	ft_stop();
+
+	return 0;
+}
+
+/*
+ * Streaming mode (-Q).  The window loops drain the pipeline at the end of
+ * every window.  Here up to window_size operations stay in flight, each
+ * posted with a context from ft_op_pool.  Slots are reused in posting
+ * order, but a slot is only reposted once the completion for its own
+ * context has been read, since completions may arrive out of order.
+ * Received messages are consumed in order: message k is done once the
+ * receive for its slot has completed.
+ *
+ * When the peer must post receives, it hands out credits instead of acking
+ * each window.  A credit message carries the number of receives posted so
+ * far and is sent after every batch of reposts.  The last credit message
+ * instead carries the negated number of credit messages sent, so that the
+ * sender consumes all of them before the loop returns.
+ */
+static struct {
+	int granted;
+	int msgs;
+	int expect;
+	int last;
+} credit;
+
+static inline int bw_stream_batch(void)
 {
-	if (opts.window_size > 0) {
-		tx_ctx_arr = calloc(opts.window_size, sizeof(struct fi_context));
-		if (!tx_ctx_arr)
-			return -FI_ENOMEM;
-	}
-	return 0;
+	return MIN(ft_comp_batch(), opts.window_size);
 }
 
-int pingpong(void)
+/* rx_seq is always one ahead, so a receive for the next credit is posted */
+static int bw_credit_recv(void)
 {
-	int ret, i;
+	int val, ret;
 
-	ret = ft_sync();
+	ret = ft_get_rx_comp(rx_seq);
 	if (ret)
 		return ret;
 
-	if (opts.dst_addr) {
-		for (i = 0; i < opts.iterations + opts.warmup_iterations; i++) {
-			if (i == opts.warmup_iterations)
-				ft_start();
+	val = *(int *) (rx_buf + ft_rx_prefix_size());
+	credit.msgs++;
+	if (val < 0)
+		credit.expect = -val;
+	else
+		credit.granted = MAX(credit.granted, val);
 
-			if (opts.transfer_size < fi->tx_attr->inject_size)
-				ret = ft_inject(ep, opts.transfer_size);
-			else
-				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size, &tx_ctx);
-			if (ret)
-				return ret;
+	return ft_post_rx(ep, rx_size, &rx_ctx);
+}
 
-			ret = ft_rx(ep, opts.transfer_size);
-			if (ret)
-				return ret;
+static int bw_credit_send(int val)
+{
+	int ret;
+
+	*(int *) (tx_buf + ft_tx_prefix_size()) = val;
+	credit.msgs++;
+	if (sizeof val < fi->tx_attr->inject_size)
+		return ft_post_inject_buf(ep, sizeof val, tx_buf);
+
+	ret = ft_post_tx(ep, remote_fi_addr, sizeof val, &tx_ctx);
+	if (ret)
+		return ret;
+	return ft_get_tx_comp(tx_seq);
+}
+
+static int bw_stream_tx(int iters, int warmup,
+			int (*post)(int i, int j, int warmup), int credits)
+{
+	int ret, i, j;
+
+	credit.granted = credit.msgs = credit.expect = 0;
+	for (i = 0; i < iters + warmup; i++) {
+		if (i == warmup) {
+			ft_start();
+			adapt_start();
 		}
-	} else {
-		for (i = 0; i < opts.iterations + opts.warmup_iterations; i++) {
-			if (i == opts.warmup_iterations)
-				ft_start();
 
-			ret = ft_rx(ep, opts.transfer_size);
+		while (credits && i >= credit.granted) {
+			ret = bw_credit_recv();
 			if (ret)
 				return ret;
+		}
 
-			if (opts.transfer_size < fi->tx_attr->inject_size)
-				ret = ft_inject(ep, opts.transfer_size);
-			else
-				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size, &tx_ctx);
+		j = i % opts.window_size;
+		while (!ft_op_pool.op[j].done) {
+			ret = ft_get_tx_comp(MIN(tx_cq_cntr + bw_stream_batch(),
+						 tx_seq));
 			if (ret)
 				return ret;
 		}
+
+		ret = post(i, j, warmup);
+		if (ret)
+			return ret;
+
+		if (i >= warmup && (i + 1 - warmup) % opts.window_size == 0)
+			adapt_sample(opts.window_size);
 	}
-	ft_stop();
 
-	if (opts.machr)
-		show_perf_mr(opts.transfer_size, opts.iterations, &start, &end, 2,
-				opts.argc, opts.argv);
-	else
-		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 2);
+	ret = ft_get_tx_comp(tx_seq);
+	if (ret)
+		return ret;
+
+	while (credits && (!credit.expect || credit.msgs < credit.expect)) {
+		ret = bw_credit_recv();
+		if (ret)
+			return ret;
+	}
+	ft_stop();
 
 	return 0;
 }
 
-static int bw_tx_comp()
+/*
+ * Receive k of a run takes message k.  Receive 0 is the one left over from
+ * before the loop and receive iters + warmup is left over for afterwards;
+ * both target rx_buf, the others the slot k % window_size.  The leftover
+ * alternates between two contexts, since the previous one may still be
+ * outstanding when it is posted.
+ */
+static int bw_stream_post_rx(size_t size, int k, int total)
 {
-	int ret;
+	static int ctx;
+	int j = k % opts.window_size;
 
-	ret = ft_get_tx_comp(tx_seq);
-	if (ret)
-		return ret;
-	return ft_rx(ep, 4);
+	if (k == total) {
+		ctx ^= 1;
+		return ft_post_rx(ep, size, &rx_ctx_arr[ctx]);
+	}
+
+	if (!ft_pool.slot_cnt)
+		return ft_post_rx(ep, size, bw_tx_ctx(j));
+	return ft_post_rx_buf(ep, size, bw_tx_ctx(j), ft_rx_slot(j));
 }
 
-static int bw_rx_comp()
+/*
+ * Message 0 lands in the leftover receive, which is not from the pool: it
+ * is done once more completions were read than pool contexts reaped.
+ */
+static inline int bw_stream_done(int k, uint64_t base, uint64_t pool_base)
 {
-	int ret;
-
-	/* rx_seq is always one ahead */
-	ret = ft_get_rx_comp(rx_seq - 1);
-	if (ret)
-		return ret;
-	return ft_tx(ep, remote_fi_addr, 4, &tx_ctx);
+	if (!k)
+		return rx_cq_cntr - base > ft_op_pool.reaped - pool_base;
+	return ft_op_pool.op[k % opts.window_size].done;
 }
 
-int bandwidth(void)
+static int bw_stream_check(int from, int to, int warmup)
 {
-	int ret, i, j;
+	char *buf;
+	int m;
 
-	ret = ft_sync();
-	if (ret)
-		return ret;
+	for (m = from; m < to; m++) {
+		if (!bw_verify(m, warmup))
+			continue;
+		buf = m ? ft_rx_slot(m % opts.window_size) : rx_buf;
+		if (ft_check_buf(buf + ft_rx_prefix_size(), opts.transfer_size))
+			return -FI_EIO;
+	}
+	return 0;
+}
 
-	/* The loop structured allows for the possibility that the sender
-	 * immediately overruns the receiving side on the first transfer (or
-	 * the entire window). This could result in exercising parts of the
-	 * provider's implementation of FI_RM_ENABLED. For better or worse,
-	 * some MPI-level benchmarks tend to use this type of loop for measuring
-	 * bandwidth.  */
+/* Messages are only verified when size is non-zero */
+static int bw_stream_rx(int iters, int warmup, size_t size)
+{
+	uint64_t base = rx_cq_cntr, pool_base = ft_op_pool.reaped;
+	int total = iters + warmup, next = 1, done = 0, prev;
+	int ret;
 
-	if (opts.dst_addr) {
-		for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
-			if (i == opts.warmup_iterations)
-				ft_start();
+	credit.msgs = credit.last = 0;
+	if (!warmup)
+		ft_start();
 
-			if (opts.transfer_size < fi->tx_attr->inject_size)
-				ret = ft_inject(ep, opts.transfer_size);
-			else
-				ret = ft_post_tx(ep, remote_fi_addr, opts.transfer_size,
-						 &tx_ctx_arr[j]);
+	while (done < total) {
+		for (; next <= total && next < done + opts.window_size; next++) {
+			ret = bw_stream_post_rx(size, next, total);
 			if (ret)
 				return ret;
+		}
 
-			if (++j == opts.window_size) {
-				ret = bw_tx_comp();
-				if (ret)
-					return ret;
-				j = 0;
-			}
+		if (MIN(next, total) > credit.last) {
+			credit.last = MIN(next, total);
+			ret = bw_credit_send(credit.last);
+			if (ret)
+				return ret;
 		}
-		ret = bw_tx_comp();
+
+		/* The leftover receive (total) completes after the loop */
+		ret = ft_get_rx_comp(rx_cq_cntr + MIN(bw_stream_batch(),
+				     MIN(next, total) -
+				     (int) (rx_cq_cntr - base)));
 		if (ret)
 			return ret;
-	} else {
-		for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
-			if (i == opts.warmup_iterations)
-				ft_start();
 
-			ret = ft_post_rx(ep, opts.transfer_size, &tx_ctx_arr[j]);
+		prev = done;
+		while (done < next && bw_stream_done(done, base, pool_base))
+			done++;
+		if (prev < warmup && done >= warmup)
+			ft_start();
+
+		if (size) {
+			ret = bw_stream_check(prev, done, warmup);
 			if (ret)
 				return ret;
-
-			if (++j == opts.window_size) {
-				ret = bw_rx_comp();
-				if (ret)
-					return ret;
-				j = 0;
-			}
 		}
-		ret = bw_rx_comp();
+	}
+
+	for (; next <= total; next++) {
+		ret = bw_stream_post_rx(size, next, total);
 		if (ret)
 			return ret;
 	}
+
+	ret = bw_credit_send(-(credit.msgs + 1));
+	if (ret)
+		return ret;
 	ft_stop();
 
-	if (opts.machr)
-		show_perf_mr(opts.transfer_size, opts.iterations, &start, &end, 1,
-				opts.argc, opts.argv);
-	else
-		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 1);
+	return 0;
+}
+
+static int bandwidth_stream_loop(int iters, int warmup)
+{
+	if (opts.dst_addr)
+		return bw_stream_tx(iters, warmup, bw_post_msg, 1);
+	return bw_stream_rx(iters, warmup, opts.transfer_size);
+}
 
+static int bw_check_modes(void)
+{
+	if ((opts.options & FT_OPT_STREAM) && (!txcq || !rxcq)) {
+		FT_ERR("-Q requires completion queues");
+		return -FI_EINVAL;
+	}
+	if (!bw_sel.interval)
+		return 0;
+	if (!txcq || (opts.options & FT_OPT_STREAM)) {
+		FT_ERR("-Z requires a transmit CQ and is not supported with -Q");
+		return -FI_EINVAL;
+	}
 	return 0;
 }
 
+/*
+ * Runs the loop once, or with -Z all once per signaling interval from 1
+ * to the window size, each reported as its own row.
+ */
+static int bw_sel_run(bench_loop_fn loop)
+{
+	char name[FT_STR_LEN], *prev = bench_name;
+	int ret;
+
+	if (bw_sel.interval >= 0) {
+		bw_sel.cur = MIN(MAX(bw_sel.interval, 1), opts.window_size);
+		return bench_run(loop, 1);
+	}
+
+	for (bw_sel.cur = 1; ; bw_sel.cur = MIN(bw_sel.cur * 2,
+						opts.window_size)) {
+		if (bw_sel.cur > 1) {
+			ret = ft_sync();
+			if (ret)
+				break;
+		}
+		snprintf(name, sizeof name, "signal 1/%d", bw_sel.cur);
+		bench_name = name;
+		ret = bench_run(loop, 1);
+		if (ret || bw_sel.cur >= opts.window_size)
+			break;
+	}
+	bench_name = prev;
+	return ret;
+}
+
+int bandwidth(void)
+{
+	bench_loop_fn loop;
+	int ret;
+
+	ret = bw_check_modes();
+	if (ret)
+		return ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.options & FT_OPT_RESIDENCY)
+		ft_hist_reset(&res_hist);
+
+	if (opts.options & FT_OPT_STREAM)
+		loop = bandwidth_stream_loop;
+	else if (opts.dst_addr)
+		loop = bench_kernel(bw_tx_kernels, bench_msg_op(),
+				    bandwidth_loop);
+	else
+		loop = bench_kernel(bw_rx_kernels, hints->caps & FI_TAGGED ?
+				    BENCH_OP_TSEND : BENCH_OP_SEND,
+				    bandwidth_loop);
+	return bw_sel_run(loop);
+}
+
 static int bw_rma_comp(enum ft_rma_opcodes rma_op)
 {
 	int ret;
@@ -244,53 +1510,51 @@ static int bw_rma_comp(enum ft_rma_opcodes rma_op)
 	return 0;
 }
 
-int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
+static int bw_post_rma(int i, int j, int warmup)
 {
-	int ret, i, j;
+	if (bw_sel.interval)
+		return ft_post_rma_flags(bw_rma_op, ep, opts.transfer_size,
+				bw_rma_remote, bw_tx_ctx(j),
+				bw_rma_op == FT_RMA_READ ?
+				ft_rx_slot(j) : ft_tx_slot(j),
+				bw_rma_op == FT_RMA_READ ?
+				bw_sel_flags(i, j) & ~FI_INJECT :
+				bw_sel_flags(i, j));
 
-	ret = ft_sync();
-	if (ret)
-		return ret;
+	switch (bw_rma_op) {
+	case FT_RMA_WRITE:
+	case FT_RMA_WRITEDATA:
+		if (opts.transfer_size < fi->tx_attr->inject_size)
+			return ft_post_rma_inject_buf(bw_rma_op, ep,
+					opts.transfer_size, bw_rma_remote,
+					ft_tx_slot(j));
+		return ft_post_rma_buf(bw_rma_op, ep, opts.transfer_size,
+				bw_rma_remote, bw_tx_ctx(j), ft_tx_slot(j));
+	case FT_RMA_READ:
+		return ft_post_rma_buf(FT_RMA_READ, ep, opts.transfer_size,
+				bw_rma_remote, bw_tx_ctx(j), ft_rx_slot(j));
+	default:
+		FT_ERR("Unknown RMA op type\n");
+		return EXIT_FAILURE;
+	}
+}
 
-	for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
-		if (i == opts.warmup_iterations)
-			ft_start();
+static int bandwidth_rma_loop(int iters, int warmup)
+{
+	enum ft_rma_opcodes rma_op = bw_rma_op;
+	int ret, i, j;
 
-		switch (rma_op) {
-		case FT_RMA_WRITE:
-			if (opts.transfer_size < fi->tx_attr->inject_size) {
-				ret = ft_post_rma_inject(FT_RMA_WRITE, ep,
-						opts.transfer_size, remote);
-			} else {
-				ret = ft_post_rma(rma_op, ep, opts.transfer_size,
-						remote,	&tx_ctx_arr[j]);
-			}
-			break;
-		case FT_RMA_WRITEDATA:
-			if (!opts.dst_addr) {
-				ret = ft_post_rx(ep, 0, &tx_ctx_arr[j]);
-			} else {
-				if (opts.transfer_size < fi->tx_attr->inject_size) {
-					ret = ft_post_rma_inject(FT_RMA_WRITEDATA,
-							ep,
-							opts.transfer_size,
-							remote);
-				} else {
-					ret = ft_post_rma(FT_RMA_WRITEDATA,
-							ep,
-							opts.transfer_size,
-							remote,	&tx_ctx_arr[j]);
-				}
-			}
-			break;
-		case FT_RMA_READ:
-			ret = ft_post_rma(FT_RMA_READ, ep, opts.transfer_size,
-					remote,	&tx_ctx_arr[j]);
-			break;
-		default:
-			FT_ERR("Unknown RMA op type\n");
-			return EXIT_FAILURE;
+	bw_sel.last = iters + warmup - 1;
+	for (i = j = 0; i < iters + warmup; i++) {
+		if (i == warmup) {
+			ft_start();
+			adapt_start();
 		}
+
+		if (rma_op == FT_RMA_WRITEDATA && !opts.dst_addr)
+			ret = bw_post_rx(0, i, j, iters + warmup - 1);
+		else
+			ret = bw_post_rma(i, j, warmup);
 		if (ret)
 			return ret;
 
@@ -299,6 +1563,8 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 			if (ret)
 				return ret;
 			j = 0;
+			if (i >= warmup)
+				adapt_sample(opts.window_size);
 		}
 	}
 	ret = bw_rma_comp(rma_op);
@@ -306,10 +1572,169 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 		return ret;
 	ft_stop();
 
-	if (opts.machr)
-		show_perf_mr(opts.transfer_size, opts.iterations, &start, &end,	1,
-				opts.argc, opts.argv);
+	return 0;
+}
+
+/* Only writedata needs the target to post receives */
+static int bandwidth_rma_stream_loop(int iters, int warmup)
+{
+	if (bw_rma_op != FT_RMA_WRITEDATA)
+		return bw_stream_tx(iters, warmup, bw_post_rma, 0);
+	if (opts.dst_addr)
+		return bw_stream_tx(iters, warmup, bw_post_rma, 1);
+	return bw_stream_rx(iters, warmup, 0);
+}
+
+int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
+{
+	bench_loop_fn loop;
+	int ret;
+
+	ret = bw_check_modes();
+	if (ret)
+		return ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.options & FT_OPT_RESIDENCY)
+		ft_hist_reset(&res_hist);
+
+	bw_rma_op = rma_op;
+	bw_rma_remote = remote;
+	if (opts.options & FT_OPT_STREAM)
+		loop = bandwidth_rma_stream_loop;
+	else if (rma_op == FT_RMA_WRITEDATA && !opts.dst_addr)
+		loop = bench_kernel(bw_rx_kernels, BENCH_OP_WRITEDATA,
+				    bandwidth_rma_loop);
 	else
-		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 1);
+		loop = bench_kernel(bw_tx_kernels, bench_rma_op(rma_op),
+				    bandwidth_rma_loop);
+	return bw_sel_run(loop);
+}
+
+/*
+ * RMA ping-pong.  Each side writes into the peer's rx_buf and the peer
+ * busy-polls the last byte of the payload, which carries a sequence tag
+ * that changes on every iteration and is never 0.  No receive or remote
+ * completion is involved, except for writedata, where the target waits for
+ * the remote CQ data completion instead.  This relies on the provider
+ * placing the last byte of a write last.
+ *
+ * Control messages (at most 16 bytes) also land in rx_buf, so payloads
+ * shorter than FT_PP_RMA_MIN are written to end at FT_PP_RMA_MIN, out of
+ * their way.  Local transmit completions are reaped lazily, before the next
+ * write, so they stay off the round trip.
+ */
+#define FT_PP_RMA_MIN	32
+
+static enum ft_rma_opcodes pp_rma_op;
+static struct fi_rma_iov pp_rma_remote;
+static int pp_rma_inject;
+static uint8_t pp_rma_tag;
+
+static inline size_t pp_rma_off(void)
+{
+	return opts.transfer_size < FT_PP_RMA_MIN ?
+	       FT_PP_RMA_MIN - opts.transfer_size : 0;
+}
+
+static int pp_rma_post(uint8_t tag)
+{
+	struct fi_rma_iov remote = pp_rma_remote;
+	int ret;
+
+	ret = ft_get_tx_comp(tx_seq);
+	if (ret)
+		return ret;
+
+	((uint8_t *) tx_buf)[opts.transfer_size - 1] = tag;
+	remote.addr += pp_rma_off();
+	if (pp_rma_inject)
+		return ft_post_rma_inject_buf(pp_rma_op, ep, opts.transfer_size,
+					      &remote, tx_buf);
+	return ft_post_rma_buf(pp_rma_op, ep, opts.transfer_size, &remote,
+			       &tx_ctx, tx_buf);
+}
+
+/* Times out like the spin completion path, after timeout seconds */
+static int pp_rma_wait(uint8_t tag)
+{
+	volatile uint8_t *flag;
+	uint64_t begin = 0;
+	int polls = 0;
+
+	if (pp_rma_op == FT_RMA_WRITEDATA)
+		return ft_rx(ep, 0);
+
+	if (timeout >= 0) {
+		ft_timer_init();
+		begin = ft_gettime_ns();
+	}
+
+	flag = (uint8_t *) rx_buf + ft_rx_prefix_size() + pp_rma_off() +
+	       opts.transfer_size - 1;
+	while (*flag != tag) {
+		/* drive progress for providers that need it */
+		if (fi->domain_attr->data_progress == FI_PROGRESS_MANUAL)
+			(void) fi_cq_read(txcq, NULL, 0);
+
+		if (timeout >= 0 && ++polls == FT_TIMEOUT_POLLS) {
+			polls = 0;
+			if ((ft_gettime_ns() - begin) / 1000000000ULL >
+			    (uint64_t) timeout) {
+				fprintf(stderr, "%ds timeout expired\n", timeout);
+				return -FI_ENODATA;
+			}
+		}
+	}
 	return 0;
 }
+
+static int pingpong_rma_loop(int iters, int warmup)
+{
+	int ret, i;
+
+	for (i = 0; i < iters + warmup; i++) {
+		pingpong_start(i, warmup);
+		pp_rma_tag = pp_rma_tag % 255 + 1;
+
+		if (opts.dst_addr) {
+			ret = pp_rma_post(pp_rma_tag);
+			if (ret)
+				return ret;
+			ret = pp_rma_wait(pp_rma_tag);
+		} else {
+			ret = pp_rma_wait(pp_rma_tag);
+			if (ret)
+				return ret;
+			ret = pp_rma_post(pp_rma_tag);
+		}
+		if (ret)
+			return ret;
+
+		pingpong_stamp(i, warmup);
+	}
+	ft_stop();
+
+	return ft_get_tx_comp(tx_seq);
+}
+
+int pingpong_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote,
+		 int inject)
+{
+	int ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.options & FT_OPT_LAT_HIST)
+		ft_hist_reset(&lat_hist);
+
+	pp_rma_op = rma_op;
+	pp_rma_remote = *remote;
+	pp_rma_inject = inject;
+	return bench_run(pingpong_rma_loop, 2);
+}
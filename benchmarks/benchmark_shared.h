@@ -40,15 +40,20 @@ extern "C" {
 
 #include <stdbool.h>
 
-#define BENCHMARK_OPTS "vkj:W:"
+#define BENCHMARK_OPTS "vV:kj:W:Hb:A:uQRZ:D:i:"
 #define FT_BENCHMARK_MAX_MSG_SIZE (test_size[TEST_CNT - 1].size)
 
+/* Name of the result rows printed by the calls below, NULL for none */
+extern char *bench_name;
+
 void ft_parse_benchmark_opts(int op, char *optarg);
 void ft_benchmark_usage(void);
 int ft_bw_init(void);
 int pingpong(void);
 int bandwidth(void);
 int bandwidth_rma(enum ft_rma_opcodes op, struct fi_rma_iov *remote);
+int pingpong_rma(enum ft_rma_opcodes op, struct fi_rma_iov *remote,
+		int inject);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <complex.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_atomic.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Atomic latency and message rate.  For every (op, datatype, count) the
+ * provider supports, base, fetch and compare atomics (whichever apply to
+ * the op) are run twice: once waiting for each completion (latency) and
+ * once keeping window_size operations in flight (rate).  Both sides issue
+ * atomics to the peer's rx_buf.  Fetched results land in a slot per
+ * window entry.
+ */
+#define FT_ATOMIC_MAX_COUNT	64
+
+enum atomic_kind {
+	ATOMIC_BASE,
+	ATOMIC_FETCH,
+	ATOMIC_COMPARE,
+};
+
+static const char *kind_str[] = {
+	[ATOMIC_BASE] = "base",
+	[ATOMIC_FETCH] = "fetch",
+	[ATOMIC_COMPARE] = "compare",
+};
+
+static struct fi_rma_iov remote;
+static enum fi_op op_type = FI_MIN;
+static int run_all_ops = 1;
+static int dt_sel = -1;
+static size_t count_sel = 1;
+static int run_all_counts;
+
+static char *result;
+static char *compare;
+static struct fid_mr *mr_result;
+static struct fid_mr *mr_compare;
+static size_t slot_size;
+
+static size_t datatype_size(enum fi_datatype datatype)
+{
+	switch (datatype) {
+	case FI_INT8:   return sizeof(int8_t);
+	case FI_UINT8:  return sizeof(uint8_t);
+	case FI_INT16:  return sizeof(int16_t);
+	case FI_UINT16: return sizeof(uint16_t);
+	case FI_INT32:  return sizeof(int32_t);
+	case FI_UINT32: return sizeof(uint32_t);
+	case FI_FLOAT:  return sizeof(float);
+	case FI_INT64:  return sizeof(int64_t);
+	case FI_UINT64: return sizeof(uint64_t);
+	case FI_DOUBLE: return sizeof(double);
+	case FI_FLOAT_COMPLEX: return sizeof(float complex);
+	case FI_DOUBLE_COMPLEX: return sizeof(double complex);
+	case FI_LONG_DOUBLE: return sizeof(long double);
+	case FI_LONG_DOUBLE_COMPLEX: return sizeof(long double complex);
+	default:        return 0;
+	}
+}
+
+/* Names match fi_tostr() without the FI_ prefix, e.g. sum, cswap, int32 */
+static int parse_op(const char *str)
+{
+	enum fi_op op;
+
+	if (!strcasecmp(str, "read"))
+		return FI_ATOMIC_READ;
+	if (!strcasecmp(str, "write"))
+		return FI_ATOMIC_WRITE;
+
+	for (op = FI_MIN; op < FI_ATOMIC_OP_LAST; op++) {
+		if (!strcasecmp(str, fi_tostr(&op, FI_TYPE_ATOMIC_OP) + 3))
+			return op;
+	}
+	return -1;
+}
+
+static int parse_datatype(const char *str)
+{
+	enum fi_datatype dt;
+
+	for (dt = 0; dt <= FI_LONG_DOUBLE_COMPLEX; dt++) {
+		if (!strcasecmp(str, fi_tostr(&dt, FI_TYPE_ATOMIC_TYPE) + 3))
+			return dt;
+	}
+	return -1;
+}
+
+static enum atomic_kind first_kind(enum fi_op op)
+{
+	switch (op) {
+	case FI_ATOMIC_READ:
+		return ATOMIC_FETCH;
+	case FI_CSWAP:
+	case FI_CSWAP_NE:
+	case FI_CSWAP_LE:
+	case FI_CSWAP_LT:
+	case FI_CSWAP_GE:
+	case FI_CSWAP_GT:
+	case FI_MSWAP:
+		return ATOMIC_COMPARE;
+	default:
+		return ATOMIC_BASE;
+	}
+}
+
+/* Largest count the provider allows for this combination, 0 if none */
+static size_t valid_count(enum atomic_kind kind, enum fi_datatype dt)
+{
+	size_t cnt;
+	int ret;
+
+	switch (kind) {
+	case ATOMIC_BASE:
+		ret = fi_atomicvalid(ep, dt, op_type, &cnt);
+		break;
+	case ATOMIC_FETCH:
+		ret = fi_fetch_atomicvalid(ep, dt, op_type, &cnt);
+		break;
+	default:
+		ret = fi_compare_atomicvalid(ep, dt, op_type, &cnt);
+		break;
+	}
+	return ret ? 0 : MIN(cnt, FT_ATOMIC_MAX_COUNT);
+}
+
+static ssize_t post_atomic(enum atomic_kind kind, enum fi_datatype dt,
+			   size_t cnt, int j)
+{
+	void *res = result + j * slot_size;
+	ssize_t ret;
+
+	while (1) {
+		switch (kind) {
+		case ATOMIC_BASE:
+			ret = fi_atomic(ep, tx_buf, cnt, fi_mr_desc(mr),
+					remote_fi_addr, remote.addr, remote.key,
+					dt, op_type, &tx_ctx_arr[j]);
+			break;
+		case ATOMIC_FETCH:
+			ret = fi_fetch_atomic(ep, tx_buf, cnt, fi_mr_desc(mr),
+					res, fi_mr_desc(mr_result),
+					remote_fi_addr, remote.addr, remote.key,
+					dt, op_type, &tx_ctx_arr[j]);
+			break;
+		default:
+			ret = fi_compare_atomic(ep, tx_buf, cnt, fi_mr_desc(mr),
+					compare, fi_mr_desc(mr_compare),
+					res, fi_mr_desc(mr_result),
+					remote_fi_addr, remote.addr, remote.key,
+					dt, op_type, &tx_ctx_arr[j]);
+			break;
+		}
+		if (ret != -FI_EAGAIN)
+			break;
+
+		if (tx_seq != tx_cq_cntr) {
+			ret = ft_get_tx_comp(tx_cq_cntr + 1);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (ret) {
+		FT_PRINTERR("fi_atomic", ret);
+		return ret;
+	}
+	tx_seq++;
+	return 0;
+}
+
+/* With a window of 1 every operation waits for its completion */
+static int atomic_loop(enum atomic_kind kind, enum fi_datatype dt,
+		       size_t cnt, int window)
+{
+	int ret, i, j;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
+		if (i == opts.warmup_iterations)
+			ft_start();
+
+		ret = post_atomic(kind, dt, cnt, j);
+		if (ret)
+			return ret;
+
+		if (++j == window) {
+			ret = ft_get_tx_comp(tx_seq);
+			if (ret)
+				return ret;
+			j = 0;
+		}
+	}
+	ret = ft_get_tx_comp(tx_seq);
+	if (ret)
+		return ret;
+	ft_stop();
+
+	return 0;
+}
+
+static int run_kind(enum atomic_kind kind, enum fi_datatype dt, size_t cnt)
+{
+	char name[FT_MAX_CTRL_MSG];
+	int len, ret;
+
+	/* fi_tostr() returns a static buffer, so one call per snprintf */
+	len = snprintf(name, sizeof name, "%s_",
+		       fi_tostr(&dt, FI_TYPE_ATOMIC_TYPE));
+	len += snprintf(name + len, sizeof name - len, "%s_%s_n%zu_",
+			fi_tostr(&op_type, FI_TYPE_ATOMIC_OP), kind_str[kind],
+			cnt);
+	len = MIN(len, (int) sizeof name - 1);
+	opts.transfer_size = cnt * datatype_size(dt);
+
+	ret = atomic_loop(kind, dt, cnt, 1);
+	if (ret)
+		return ret;
+	snprintf(name + len, sizeof name - len, "lat");
+	show_perf(name, opts.transfer_size, opts.iterations, &start, &end, 1);
+
+	ret = atomic_loop(kind, dt, cnt, opts.window_size);
+	if (ret)
+		return ret;
+	snprintf(name + len, sizeof name - len, "rate");
+	show_perf(name, opts.transfer_size, opts.iterations, &start, &end, 1);
+	return 0;
+}
+
+static int run_op(void)
+{
+	enum atomic_kind kind, last;
+	enum fi_datatype dt;
+	size_t cnt, max;
+	int ret;
+
+	/* base ops also run as fetch atomics */
+	kind = first_kind(op_type);
+	last = kind == ATOMIC_BASE ? ATOMIC_FETCH : kind;
+	for (; kind <= last; kind++) {
+		for (dt = 0; dt <= FI_LONG_DOUBLE_COMPLEX; dt++) {
+			if (dt_sel >= 0 && dt != (enum fi_datatype) dt_sel)
+				continue;
+
+			max = valid_count(kind, dt);
+			if (!max)
+				continue;
+
+			for (cnt = run_all_counts ? 1 : count_sel; cnt <= max;
+			     cnt *= 2) {
+				ret = run_kind(kind, dt, cnt);
+				if (ret)
+					return ret;
+				if (!run_all_counts)
+					break;
+			}
+		}
+	}
+	return 0;
+}
+
+static int run_test(void)
+{
+	int ret;
+
+	if (!run_all_ops)
+		return run_op();
+
+	for (op_type = FI_MIN; op_type < FI_ATOMIC_OP_LAST; op_type++) {
+		ret = run_op();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static uint64_t get_mr_key(void)
+{
+	static uint64_t user_key = FT_MR_KEY;
+
+	return fi->domain_attr->mr_mode == FI_MR_SCALABLE ?
+		user_key++ : 0;
+}
+
+static int alloc_ep_res(struct fi_info *fi)
+{
+	size_t size;
+	int ret;
+
+	/* Register buf with remote access below, not in ft_alloc_msgs() */
+	ft_skip_mr = 1;
+
+	ret = ft_alloc_active_res(fi);
+	if (ret)
+		return ret;
+
+	slot_size = FT_ATOMIC_MAX_COUNT * sizeof(long double complex);
+	size = slot_size * opts.window_size;
+	result = calloc(1, size);
+	compare = calloc(1, slot_size);
+	if (!result || !compare)
+		return -FI_ENOMEM;
+
+	ret = fi_mr_reg(domain, buf, buf_size, FI_REMOTE_READ | FI_REMOTE_WRITE,
+			0, get_mr_key(), 0, &mr, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_mr_reg", ret);
+		return ret;
+	}
+
+	ret = fi_mr_reg(domain, result, size, FI_READ | FI_WRITE, 0,
+			get_mr_key(), 0, &mr_result, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_mr_reg", ret);
+		return ret;
+	}
+
+	ret = fi_mr_reg(domain, compare, slot_size, FI_READ | FI_WRITE, 0,
+			get_mr_key(), 0, &mr_compare, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_mr_reg", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int init_fabric(void)
+{
+	int ret;
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	ret = alloc_ep_res(fi);
+	if (ret)
+		return ret;
+
+	return ft_init_ep();
+}
+
+static void free_res(void)
+{
+	FT_CLOSE_FID(mr_result);
+	FT_CLOSE_FID(mr_compare);
+	free(result);
+	free(compare);
+}
+
+static int run(void)
+{
+	int ret;
+
+	ret = init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_init_av();
+	if (ret)
+		return ret;
+
+	ret = ft_bw_init();
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	ret = run_test();
+	if (ret)
+		return ret;
+
+	return ft_finalize();
+}
+
+static void usage(char *name)
+{
+	ft_csusage(name, "Latency and message rate of atomic operations.");
+	ft_benchmark_usage();
+	FT_PRINT_OPTS_USAGE("-o <op>", "atomic op type: all|min|max|sum|prod|"
+			"lor|land|bor|band|lxor|bxor|read|write|cswap|cswap_ne|"
+			"cswap_le|cswap_lt|cswap_ge|cswap_gt|mswap (default: all)");
+	FT_PRINT_OPTS_USAGE("-z <datatype>", "atomic datatype, e.g. int32, "
+			"uint64, double (default: all)");
+	FT_PRINT_OPTS_USAGE("-n <count>", "elements per atomic, or 'all' for "
+			"powers of two up to the provider limit (default: 1)");
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_BW;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "ho:z:n:" CS_OPTS INFO_OPTS
+			    BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'o':
+			if (!strncasecmp("all", optarg, 3)) {
+				run_all_ops = 1;
+			} else {
+				run_all_ops = 0;
+				ret = parse_op(optarg);
+				if (ret < 0) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				op_type = ret;
+			}
+			break;
+		case 'z':
+			if (!strncasecmp("all", optarg, 3)) {
+				dt_sel = -1;
+			} else {
+				dt_sel = parse_datatype(optarg);
+				if (dt_sel < 0) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		case 'n':
+			run_all_counts = !strncasecmp("all", optarg, 3);
+			if (!run_all_counts) {
+				count_sel = atoi(optarg);
+				if (count_sel < 1 ||
+				    count_sel > FT_ATOMIC_MAX_COUNT) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		/* The atomic loops have none of these modes */
+		case 'A':
+		case 'D':
+		case 'H':
+		case 'i':
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'v':
+		case 'V':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	/* sizes come from datatype and count, keep buffers at full size */
+	opts.options &= ~FT_OPT_SIZE;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_ATOMICS;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	free_res();
+	ft_free_res();
+	return -ret;
+}
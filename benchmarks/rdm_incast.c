@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Many-to-one incast and, with -F, one-to-many fan-out.  The client forks
+ * peer_cnt processes that open the parent's named AV and each talk to the
+ * single server endpoint, the root.  In incast every child streams
+ * iterations messages to the root; in fan-out the root streams to the
+ * children round-robin.  Both sides keep at most window_size sends and
+ * receives posted, so a root that falls behind runs out of receives.
+ *
+ * Every message starts with the sender's id.  When a child is done it
+ * sends a report carrying its EAGAIN and CQ overrun counts.  The root
+ * times each peer from the start of the round until it has all of that
+ * peer's data (incast) or its report (fan-out), and prints a row per peer,
+ * an aggregate row and Jain's fairness index over the per-peer rates.
+ */
+enum {
+	INCAST_DATA,
+	INCAST_REPORT,
+};
+
+struct incast_hdr {
+	uint32_t id;
+	uint32_t type;
+};
+
+struct incast_report {
+	struct incast_hdr hdr;
+	uint64_t eagain;
+	uint64_t overrun;
+};
+
+struct incast_peer {
+	fi_addr_t addr;
+	int msgs;
+	uint64_t eagain;
+	uint64_t overrun;
+	struct timespec end;
+};
+
+static int peer_cnt = 4;
+static int fan_out;
+static struct incast_peer *peers;
+
+static struct {
+	int iters;
+	int rx_total;
+	int rx_done;
+	int rx_next;
+	int tx_total;
+	int tx_sent;
+	uint64_t eagain;
+	uint64_t overrun;
+} incast;
+
+static struct fi_context left_ctx[2];
+
+/*
+ * Same scheme as fi_rdm_load: receive 0 of a round is the one left over
+ * from before it and receive rx_total is left over for afterwards; both
+ * target rx_buf.  The others use slot k % window_size, once the receive
+ * last posted there has completed.  Slot contexts come from ft_op_pool:
+ * receive slot j uses entry j and send slot j entry window_size + j.  The
+ * final leftover is only posted once receive 0 has been handled.
+ */
+static int incast_post_rx(void)
+{
+	static int left;
+	struct ft_op_ctx *op;
+	struct fi_context *ctx;
+	void *buf;
+	ssize_t ret;
+	int j;
+
+	for (; incast.rx_next <= incast.rx_total &&
+	       incast.rx_next < incast.rx_done + opts.window_size; incast.rx_next++) {
+		if (incast.rx_next == incast.rx_total) {
+			if (!incast.rx_done)
+				break;
+			left ^= 1;
+			op = NULL;
+			ctx = &left_ctx[left];
+			buf = rx_buf;
+		} else {
+			j = incast.rx_next % opts.window_size;
+			op = &ft_op_pool.op[j];
+			if (!op->done)
+				break;
+			ctx = &op->ctx;
+			buf = ft_rx_slot(j);
+		}
+
+		ret = fi_recv(ep, buf, MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+			      ft_rx_prefix_size(), fi_mr_desc(mr), 0, ctx);
+		if (ret == -FI_EAGAIN) {
+			incast.eagain++;
+			break;
+		}
+		if (ret) {
+			FT_PRINTERR("fi_recv", ret);
+			return ret;
+		}
+		if (op)
+			op->done = 0;
+		rx_seq++;
+	}
+	return 0;
+}
+
+static char *incast_rx_buf(void *ctx)
+{
+	struct ft_op_ctx *op = ctx;
+
+	if (op >= ft_op_pool.op && op < ft_op_pool.op + opts.window_size)
+		return ft_rx_slot(op - ft_op_pool.op);
+	return rx_buf;
+}
+
+/* CQ entries are as large as the CQ format, not fi_cq_err_entry */
+static inline void *incast_op_context(const void *comp, int i)
+{
+	return ((const struct fi_cq_entry *) ((const char *) comp +
+		i * ft_op_pool.entry_size))->op_context;
+}
+
+static int incast_recv(char *buf)
+{
+	struct incast_report *rep;
+	struct incast_peer *peer;
+
+	rep = (struct incast_report *) (buf + ft_rx_prefix_size());
+	if (rep->hdr.id >= (uint32_t) peer_cnt) {
+		FT_ERR("Message from unknown peer %u\n", rep->hdr.id);
+		return -FI_EOTHER;
+	}
+
+	peer = &peers[rep->hdr.id];
+	if (rep->hdr.type == INCAST_REPORT) {
+		peer->eagain = rep->eagain;
+		peer->overrun = rep->overrun;
+		if (fan_out)
+			ft_timer_gettime(&peer->end);
+	} else if (++peer->msgs == incast.iters) {
+		ft_timer_gettime(&peer->end);
+	}
+	return 0;
+}
+
+static int incast_reap_rx(void)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	int i, cnt, ret;
+
+	if (incast.rx_done == incast.rx_total)
+		return 0;
+
+	cnt = fi_cq_read(rxcq, comp, MIN(incast.rx_total - incast.rx_done,
+					 ft_comp_batch()));
+	if (cnt == -FI_EAGAIN)
+		return 0;
+	if (cnt == -FI_EOVERRUN) {
+		incast.overrun++;
+		return 0;
+	}
+	if (cnt == -FI_EAVAIL)
+		return ft_cq_readerr(rxcq);
+	if (cnt < 0) {
+		FT_PRINTERR("fi_cq_read", cnt);
+		return cnt;
+	}
+
+	ft_op_reap(comp, cnt);
+	rx_cq_cntr += cnt;
+	incast.rx_done += cnt;
+	if (!opts.dst_addr) {
+		for (i = 0; i < cnt; i++) {
+			ret = incast_recv(incast_rx_buf(incast_op_context(comp,
+									  i)));
+			if (ret)
+				return ret;
+		}
+	}
+
+	return incast_post_rx();
+}
+
+static int incast_reap_tx(void)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	int ret;
+
+	if (tx_seq == tx_cq_cntr)
+		return 0;
+
+	ret = fi_cq_read(txcq, comp, MIN(tx_seq - tx_cq_cntr,
+					 (uint64_t) ft_comp_batch()));
+	if (ret > 0) {
+		ft_op_reap(comp, ret);
+		tx_cq_cntr += ret;
+		return 0;
+	}
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EOVERRUN) {
+		incast.overrun++;
+		return 0;
+	}
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+
+	FT_PRINTERR("fi_cq_read", ret);
+	return ret;
+}
+
+/*
+ * Post the next message: data to the root, or round-robin to the children
+ * from the root.  A child's last message is its report, which a receiving
+ * child only sends once it has all of its data.  Slots are reused in
+ * posting order, once the slot's previous send has completed.
+ */
+static int incast_post_tx(void)
+{
+	int j = incast.tx_sent % opts.window_size;
+	struct ft_op_ctx *op = &ft_op_pool.op[opts.window_size + j];
+	char *buf = ft_tx_slot(j);
+	struct incast_report *rep;
+	fi_addr_t addr = remote_fi_addr;
+	size_t size = opts.transfer_size;
+	ssize_t ret;
+
+	if (!op->done)
+		return 0;
+
+	rep = (struct incast_report *) (buf + ft_tx_prefix_size());
+	if (opts.dst_addr && incast.tx_sent == incast.tx_total - 1) {
+		if (incast.rx_done < incast.rx_total)
+			return 0;
+		rep->hdr.type = INCAST_REPORT;
+		rep->eagain = incast.eagain;
+		rep->overrun = incast.overrun;
+		size = sizeof *rep;
+	} else {
+		rep->hdr.type = INCAST_DATA;
+		if (!opts.dst_addr)
+			addr = peers[incast.tx_sent % peer_cnt].addr;
+	}
+	rep->hdr.id = ft_child_id;
+
+	ret = fi_send(ep, buf, size + ft_tx_prefix_size(), fi_mr_desc(mr),
+		      addr, &op->ctx);
+	if (ret == -FI_EAGAIN) {
+		incast.eagain++;
+		return 0;
+	}
+	if (ret) {
+		FT_PRINTERR("fi_send", ret);
+		return ret;
+	}
+	op->done = 0;
+	tx_seq++;
+	incast.tx_sent++;
+	return 0;
+}
+
+/* Every child checks in with the root, which then releases them together */
+static int incast_sync(void)
+{
+	int i, ret;
+
+	if (opts.dst_addr)
+		return ft_sync();
+
+	for (i = 0; i < peer_cnt; i++) {
+		ret = ft_rx(ep, 1);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < peer_cnt; i++) {
+		ret = ft_tx(ep, peers[i].addr, 1, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void incast_show_perf(void)
+{
+	char name[FT_MAX_CTRL_MSG];
+	const char *role = fan_out ? "receiver" : "sender";
+	uint64_t eagain = 0, overrun = 0;
+	double rate, sum = 0, sum_sq = 0;
+	int i;
+
+	for (i = 0; i < peer_cnt; i++) {
+		snprintf(name, sizeof name, "%s %d (eagain %" PRIu64 ")",
+			 role, i, peers[i].eagain);
+		show_perf(name, opts.transfer_size, incast.iters, &start,
+			  &peers[i].end, 1);
+
+		rate = (double) incast.iters /
+		       MAX(get_elapsed(&start, &peers[i].end, NANO), 1);
+		sum += rate;
+		sum_sq += rate * rate;
+		eagain += peers[i].eagain;
+		overrun += peers[i].overrun;
+	}
+
+	/* Jain's index: 1 when every peer gets the same rate, 1/n at worst */
+	snprintf(name, sizeof name, "all %d %ss (jain %.3f, root eagain %"
+		 PRIu64 ", overrun %" PRIu64 ")", peer_cnt, role,
+		 sum * sum / (peer_cnt * sum_sq), incast.eagain,
+		 incast.overrun + overrun);
+	show_perf(name, opts.transfer_size, incast.iters * peer_cnt, &start,
+		  &end, 1);
+}
+
+static int incast_round(int iters, int report)
+{
+	int i, ret;
+
+	ret = incast_sync();
+	if (ret)
+		return ret;
+
+	memset(&incast, 0, sizeof incast);
+	incast.iters = iters;
+	incast.rx_next = 1;
+	if (!opts.dst_addr) {
+		for (i = 0; i < peer_cnt; i++) {
+			peers[i].msgs = 0;
+			peers[i].eagain = peers[i].overrun = 0;
+		}
+		incast.rx_total = fan_out ? peer_cnt : peer_cnt * (iters + 1);
+		incast.tx_total = fan_out ? peer_cnt * iters : 0;
+	} else {
+		incast.rx_total = fan_out ? iters : 0;
+		incast.tx_total = fan_out ? 1 : iters + 1;
+	}
+
+	ret = incast_post_rx();
+	if (ret)
+		return ret;
+
+	ft_start();
+	while (incast.rx_done < incast.rx_total || incast.tx_sent < incast.tx_total ||
+	       tx_seq != tx_cq_cntr) {
+		if (incast.tx_sent < incast.tx_total) {
+			ret = incast_post_tx();
+			if (ret)
+				return ret;
+		}
+		ret = incast_reap_tx();
+		if (ret)
+			return ret;
+		ret = incast_reap_rx();
+		if (ret)
+			return ret;
+	}
+	ft_stop();
+
+	if (report && !opts.dst_addr)
+		incast_show_perf();
+	return 0;
+}
+
+static int incast_size(void)
+{
+	int ret;
+
+	init_test(&opts, test_name, sizeof(test_name));
+	if (opts.warmup_iterations) {
+		ret = incast_round(opts.warmup_iterations, 0);
+		if (ret)
+			return ret;
+	}
+	return incast_round(opts.iterations, 1);
+}
+
+/*
+ * Each child sends its id and address to the root, which inserts them in
+ * id order and replies once it has heard from all of them.  The type field
+ * of this first message carries the client's peer count instead.
+ */
+static int incast_init_av(void)
+{
+	struct incast_hdr *hdr;
+	size_t addrlen;
+	int i, ret;
+
+	if (opts.dst_addr) {
+		hdr = (struct incast_hdr *) (tx_buf + ft_tx_prefix_size());
+		hdr->id = ft_child_id;
+		hdr->type = peer_cnt;
+		addrlen = FT_MAX_CTRL_MSG - sizeof *hdr;
+		ret = fi_getname(&ep->fid, hdr + 1, &addrlen);
+		if (ret) {
+			FT_PRINTERR("fi_getname", ret);
+			return ret;
+		}
+
+		ret = ft_tx(ep, remote_fi_addr, sizeof *hdr + addrlen, &tx_ctx);
+		if (ret)
+			return ret;
+
+		return ft_rx(ep, 1);
+	}
+
+	for (i = 0; i < peer_cnt; i++) {
+		ret = ft_get_rx_comp(rx_seq);
+		if (ret)
+			return ret;
+
+		hdr = (struct incast_hdr *) (rx_buf + ft_rx_prefix_size());
+		if (hdr->type != (uint32_t) peer_cnt) {
+			FT_ERR("Peer count mismatch: local %d, peer %u\n",
+			       peer_cnt, hdr->type);
+			return -FI_EINVAL;
+		}
+		if (hdr->id >= (uint32_t) peer_cnt ||
+		    peers[hdr->id].addr != FI_ADDR_UNSPEC) {
+			FT_ERR("Unexpected peer id %u\n", hdr->id);
+			return -FI_EOTHER;
+		}
+
+		ret = ft_av_insert(av, hdr + 1, 1, &peers[hdr->id].addr, 0,
+				   NULL);
+		if (ret)
+			return ret;
+
+		ret = ft_post_rx(ep, rx_size, &rx_ctx);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < peer_cnt; i++) {
+		ret = ft_tx(ep, peers[i].addr, 1, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * The client parent only creates the named AV holding the root's address,
+ * then lets the children open it read-only and waits for them.
+ */
+static int incast_parent(void)
+{
+	int ret, ret2;
+
+	ret = ft_getinfo(hints, &fi);
+	if (!ret)
+		ret = ft_open_fabric_res();
+	if (!ret)
+		ret = ft_alloc_active_res(fi);
+	if (!ret)
+		ret = ft_av_insert(av, fi->dest_addr, 1, &remote_fi_addr, 0,
+				   NULL);
+
+	ret2 = ft_sync_pair(ret);
+	return ret ? ret : ret2;
+}
+
+static int incast_init_fabric(void)
+{
+	int i, ret;
+
+	if (opts.dst_addr) {
+		ret = ft_sync_pair(FI_SUCCESS);
+		if (ret)
+			return ret;
+
+		av_attr.flags = FI_READ;
+	} else {
+		peers = calloc(peer_cnt, sizeof(*peers));
+		if (!peers)
+			return -FI_ENOMEM;
+		for (i = 0; i < peer_cnt; i++)
+			peers[i].addr = FI_ADDR_UNSPEC;
+		av_attr.count = peer_cnt;
+	}
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	ret = ft_alloc_active_res(fi);
+	if (ret)
+		return ret;
+
+	ret = ft_init_ep();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr)
+		remote_fi_addr = ((fi_addr_t *) av_attr.map_addr)[0];
+
+	ret = incast_init_av();
+	if (ret)
+		return ret;
+
+	ret = ft_bw_init();
+	if (ret)
+		return ret;
+
+	return ft_op_pool_alloc(2 * opts.window_size);
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	if (opts.dst_addr && ft_parent_proc)
+		return incast_parent();
+
+	ret = incast_init_fabric();
+	if (ret)
+		return ret;
+
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled) ||
+			    test_size[i].size < sizeof(struct incast_hdr))
+				continue;
+			opts.transfer_size = test_size[i].size;
+			ret = incast_size();
+			if (ret)
+				return ret;
+		}
+	} else {
+		ret = incast_size();
+		if (ret)
+			return ret;
+	}
+
+	/* nobody tears down while a peer may still be sending */
+	return incast_sync();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_BW | FT_OPT_POOL;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hn:F" CS_OPTS INFO_OPTS
+			    BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'n':
+			peer_cnt = atoi(optarg);
+			break;
+		case 'F':
+			fan_out = 1;
+			break;
+		/* The incast rounds have none of these modes */
+		case 'A':
+		case 'D':
+		case 'i':
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'v':
+		case 'V':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test\n", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Many-to-one incast and one-to-many "
+					"fan-out bandwidth with forked peers.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-n <peers>", "number of client "
+					"processes, same on both sides "
+					"(default: 4)");
+			FT_PRINT_OPTS_USAGE("-F", "fan-out: the server sends to "
+					"the clients");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (peer_cnt < 1) {
+		FT_ERR("Need at least one peer\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.comp_method != FT_COMP_SPIN) {
+		FT_ERR("Only spin completions are supported\n");
+		return EXIT_FAILURE;
+	}
+	if ((opts.options & FT_OPT_SIZE) &&
+	    opts.transfer_size < sizeof(struct incast_hdr)) {
+		FT_ERR("Message size must be at least %zu bytes\n",
+		       sizeof(struct incast_hdr));
+		return EXIT_FAILURE;
+	}
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	if (opts.dst_addr) {
+		if (!opts.av_name)
+			opts.av_name = "incast_av";
+
+		ret = ft_fork_children(peer_cnt);
+		if (ret)
+			return -ret;
+	}
+
+	ret = run();
+
+	if (opts.dst_addr && ft_wait_child() && !ret)
+		ret = -FI_EOTHER;
+
+	free(peers);
+	ft_free_res();
+	return -ret;
+}
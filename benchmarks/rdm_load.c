@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Open-loop load generator.  The client issues requests on a fixed schedule
+ * at the offered load, whether or not earlier requests have been answered,
+ * and the server echoes each one back.  Request k is due at t0 + k * period,
+ * and its latency is measured from that intended send time rather than from
+ * when it was actually posted.  A stall therefore shows up in the latency of
+ * every request queued behind it instead of silently lowering the load
+ * (coordinated omission).
+ *
+ * The timer starts when request warmup is due on the client and when it
+ * arrives on the server, so only the measured requests are reported.
+ *
+ * Each message carries its sequence number in its first 8 bytes.  At most
+ * window_size requests are outstanding; if the server falls that far
+ * behind, the client waits and the wait is charged to the requests.
+ *
+ * Slot contexts come from ft_op_pool: receive slot j uses entry j and send
+ * slot j entry window_size + j.  Completions may arrive out of order, so a
+ * slot is only reposted once the completion for its own context was read.
+ */
+struct load_rate {
+	double from;
+	double to;
+	double step;
+	int gbps;
+};
+
+static struct load_rate rate = { .from = 10000 };
+
+static struct {
+	uint64_t t0;
+	double period;
+	int total;
+	int warmup;
+	int sent;
+	int done;
+	int next;
+} load;
+
+static struct fi_context left_ctx[2];
+
+static inline uint64_t load_now(void)
+{
+	return ft_timer_ticks_to_ns(ft_timer_ticks());
+}
+
+/* CQ entries are as large as the CQ format, not fi_cq_err_entry */
+static inline void *load_op_context(const void *comp, int i)
+{
+	return ((const struct fi_cq_entry *) ((const char *) comp +
+		i * ft_op_pool.entry_size))->op_context;
+}
+
+/*
+ * Receive 0 of a run is the one left over from before the run and receive
+ * total is left over for afterwards; both target rx_buf and alternate
+ * between two contexts.  Receive k otherwise uses slot k % window_size,
+ * once the receive last posted there has completed.  At most window_size
+ * receives are outstanding.
+ */
+static int load_repost(void)
+{
+	static int left;
+	struct ft_op_ctx *op;
+	int j, ret;
+
+	for (; load.next <= load.total &&
+	       load.next < load.done + opts.window_size; load.next++) {
+		if (load.next == load.total) {
+			left ^= 1;
+			ret = ft_post_rx(ep, opts.transfer_size, &left_ctx[left]);
+		} else {
+			j = load.next % opts.window_size;
+			op = &ft_op_pool.op[j];
+			if (!op->done)
+				break;
+			op->done = 0;
+			ret = ft_post_rx_buf(ep, opts.transfer_size, &op->ctx,
+					     ft_rx_slot(j));
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static char *load_rx_buf(void *ctx)
+{
+	struct ft_op_ctx *op = ctx;
+
+	if (op >= ft_op_pool.op && op < ft_op_pool.op + opts.window_size)
+		return ft_rx_slot(op - ft_op_pool.op);
+	return rx_buf;
+}
+
+static int load_reap_tx(void)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	int ret;
+
+	if (tx_seq == tx_cq_cntr)
+		return 0;
+
+	ret = fi_cq_read(txcq, comp, MIN(tx_seq - tx_cq_cntr,
+					 (uint64_t) ft_comp_batch()));
+	if (ret > 0) {
+		ft_op_reap(comp, ret);
+		tx_cq_cntr += ret;
+		return 0;
+	}
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+
+	FT_PRINTERR("fi_cq_read", ret);
+	return ret;
+}
+
+/* Slots are reused in posting order, waiting for the slot's send if needed */
+static int load_send(uint64_t seq)
+{
+	int j = load.sent++ % opts.window_size;
+	struct ft_op_ctx *op = &ft_op_pool.op[opts.window_size + j];
+	char *buf = (char *) ft_tx_slot(j);
+	int ret;
+
+	while (!op->done) {
+		ret = load_reap_tx();
+		if (ret)
+			return ret;
+	}
+
+	*(uint64_t *) (buf + ft_tx_prefix_size()) = seq;
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		return ft_post_inject_buf(ep, opts.transfer_size, buf);
+	op->done = 0;
+	return ft_post_tx_buf(ep, remote_fi_addr, opts.transfer_size,
+			      &op->ctx, buf);
+}
+
+/*
+ * Handle arrived messages: the client records each response's latency
+ * against its intended send time, the server echoes each request.  Reads
+ * stop at the run's last message, so a control message sent by the peer
+ * after the run stays on the CQ.
+ */
+static int load_reap_rx(void)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	uint64_t seq, now;
+	int i, cnt, ret;
+
+	cnt = fi_cq_read(rxcq, comp, MIN(load.total - load.done,
+					 ft_comp_batch()));
+	if (cnt == -FI_EAGAIN)
+		return 0;
+	if (cnt == -FI_EAVAIL)
+		return ft_cq_readerr(rxcq);
+	if (cnt < 0) {
+		FT_PRINTERR("fi_cq_read", cnt);
+		return cnt;
+	}
+
+	ft_op_reap(comp, cnt);
+	rx_cq_cntr += cnt;
+	load.done += cnt;
+	now = load_now();
+	for (i = 0; i < cnt; i++) {
+		seq = *(uint64_t *) (load_rx_buf(load_op_context(comp, i)) +
+				     ft_rx_prefix_size());
+		if (!opts.dst_addr) {
+			if (seq == (uint64_t) load.warmup)
+				ft_start();
+			ret = load_send(seq);
+			if (ret)
+				return ret;
+		} else if (seq >= (uint64_t) load.warmup) {
+			ft_hist_add(&lat_hist, now - load.t0 -
+				    (uint64_t) (seq * load.period));
+		}
+	}
+
+	return load_repost();
+}
+
+static int load_client(void)
+{
+	uint64_t due;
+	int ret;
+
+	load.t0 = load_now();
+	while (load.done < load.total) {
+		if (load.sent < load.total &&
+		    load.sent - load.done < opts.window_size) {
+			due = load.t0 + (uint64_t) (load.sent * load.period);
+			if (load_now() >= due) {
+				if (load.sent == load.warmup)
+					ft_start();
+				ret = load_send(load.sent);
+				if (ret)
+					return ret;
+			}
+		}
+
+		ret = load_reap_rx();
+		if (ret)
+			return ret;
+		ret = load_reap_tx();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int load_server(void)
+{
+	int ret;
+
+	while (load.done < load.total) {
+		ret = load_reap_rx();
+		if (ret)
+			return ret;
+		ret = load_reap_tx();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int load_point(double offered)
+{
+	char name[FT_MAX_CTRL_MSG];
+	int ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	ft_hist_reset(&lat_hist);
+	memset(&load, 0, sizeof load);
+	load.warmup = opts.warmup_iterations;
+	load.total = opts.iterations + load.warmup;
+	load.next = 1;
+	/* Gbit/s is bits per nanosecond */
+	load.period = rate.gbps ? opts.transfer_size * 8 / offered :
+				  1000000000.0 / offered;
+
+	ret = load_repost();
+	if (ret)
+		return ret;
+
+	ret = opts.dst_addr ? load_client() : load_server();
+	if (ret)
+		return ret;
+
+	while (tx_seq != tx_cq_cntr) {
+		ret = load_reap_tx();
+		if (ret)
+			return ret;
+	}
+	ft_stop();
+
+	snprintf(name, sizeof name, rate.gbps ? "load %g Gbit/s" :
+		 "load %g msg/s", offered);
+	show_perf(name, opts.transfer_size, opts.iterations, &start, &end, 1);
+	return 0;
+}
+
+static int load_sweep(void)
+{
+	double offered;
+	int ret;
+
+	for (offered = rate.from; offered <= rate.to * (1 + 1e-9);
+	     offered += rate.step) {
+		ret = load_point(offered);
+		if (ret)
+			return ret;
+		if (rate.step <= 0)
+			break;
+	}
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_op_pool_alloc(2 * opts.window_size);
+	if (ret)
+		return ret;
+
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled) ||
+			    test_size[i].size < sizeof(uint64_t))
+				continue;
+			opts.transfer_size = test_size[i].size;
+			init_test(&opts, test_name, sizeof(test_name));
+			ret = load_sweep();
+			if (ret)
+				return ret;
+		}
+	} else {
+		init_test(&opts, test_name, sizeof(test_name));
+		ret = load_sweep();
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+/* <rate>[:<max>:<step>], each in msg/s, or in Gbit/s with a 'g' suffix */
+static int parse_rate(char *arg)
+{
+	char *end;
+
+	rate.from = strtod(arg, &end);
+	rate.gbps = (*end == 'g' || *end == 'G');
+	if (rate.gbps)
+		end++;
+	rate.to = rate.from;
+	rate.step = 0;
+	if (*end == ':') {
+		rate.to = strtod(end + 1, &end);
+		if (rate.gbps && (*end == 'g' || *end == 'G'))
+			end++;
+		if (*end != ':')
+			return -FI_EINVAL;
+		rate.step = strtod(end + 1, &end);
+		if (rate.gbps && (*end == 'g' || *end == 'G'))
+			end++;
+	}
+
+	if (*end || rate.from <= 0 || rate.to < rate.from || rate.step < 0)
+		return -FI_EINVAL;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_POOL;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "r:h" CS_OPTS INFO_OPTS BENCHMARK_OPTS)) !=
+			-1) {
+		switch (op) {
+		case 'r':
+			if (parse_rate(optarg)) {
+				FT_ERR("Invalid rate: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		/* The open-loop schedule has none of these modes */
+		case 'A':
+		case 'D':
+		case 'i':
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'v':
+		case 'V':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test\n", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Open-loop request/response load "
+					"generator using RDM.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-r <rate>[:<max>:<step>]", "offered "
+					"load in msg/s, or Gbit/s with a g suffix; "
+					"sweeps from rate to max (default: 10000)");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (opts.comp_method != FT_COMP_SPIN) {
+		FT_ERR("Only spin completion polling is supported\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((opts.options & FT_OPT_SIZE) &&
+	    opts.transfer_size < sizeof(uint64_t)) {
+		FT_ERR("Message size must be at least %zu\n", sizeof(uint64_t));
+		return EXIT_FAILURE;
+	}
+
+	/* latency percentiles are always reported by the client */
+	if (opts.dst_addr)
+		opts.options |= FT_OPT_LAT_HIST;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = ft_bw_init();
+	if (ret)
+		return EXIT_FAILURE;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
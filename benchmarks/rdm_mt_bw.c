@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Each thread owns an endpoint context and an AV, and is paired with the
+ * thread of the same index on the peer.  Endpoint names are exchanged
+ * over the out-of-band socket, so no address is carried in-band.
+ */
+struct mt_thread {
+	pthread_t thread;
+	int id;
+	int cpu;
+	int node;
+	struct ft_ctx ctx;
+	struct fid_av *av;
+	struct fi_context *ctx_arr;
+	struct fi_context ack_ctx;
+	char name[FT_MAX_CTRL_MSG];
+	size_t namelen;
+	struct timespec start, end;
+	int ret;
+};
+
+static int thread_cnt = 1;
+static char *sock_service = "2710";
+static struct fi_info *ep_info;
+static struct mt_thread *threads;
+static pthread_barrier_t barrier;
+static size_t msg_size;
+
+static int mt_post_tx(struct mt_thread *t, size_t size, struct fi_context *ctx)
+{
+	if (size < fi->tx_attr->inject_size)
+		return ft_ctx_post_inject_buf(&t->ctx, size, t->ctx.tx_msg);
+
+	return ft_ctx_post_tx(&t->ctx, t->ctx.peer_addr, size, ctx);
+}
+
+/* The sender keeps one receive posted for the window acknowledgement. */
+static int mt_tx_comp(struct mt_thread *t)
+{
+	int ret;
+
+	ret = ft_ctx_get_tx_comp(&t->ctx, t->ctx.tx_posted);
+	if (ret)
+		return ret;
+
+	ret = ft_ctx_get_rx_comp(&t->ctx, t->ctx.rx_posted);
+	if (ret)
+		return ret;
+
+	return ft_ctx_post_rx(&t->ctx, 4, &t->ack_ctx);
+}
+
+static int mt_rx_comp(struct mt_thread *t)
+{
+	int ret;
+
+	ret = ft_ctx_get_rx_comp(&t->ctx, t->ctx.rx_posted);
+	if (ret)
+		return ret;
+
+	ret = mt_post_tx(t, 4, &t->ack_ctx);
+	if (ret)
+		return ret;
+
+	return ft_ctx_get_tx_comp(&t->ctx, t->ctx.tx_posted);
+}
+
+/* Same window loop as bandwidth(), driven on the thread's own endpoint. */
+static int mt_bandwidth(struct mt_thread *t)
+{
+	int ret, i, j;
+
+	for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
+		if (i == opts.warmup_iterations)
+			ft_timer_gettime(&t->start);
+
+		if (opts.dst_addr)
+			ret = mt_post_tx(t, opts.transfer_size, &t->ctx_arr[j]);
+		else
+			ret = ft_ctx_post_rx(&t->ctx, opts.transfer_size,
+					     &t->ctx_arr[j]);
+		if (ret)
+			return ret;
+
+		if (++j == opts.window_size) {
+			ret = opts.dst_addr ? mt_tx_comp(t) : mt_rx_comp(t);
+			if (ret)
+				return ret;
+			j = 0;
+		}
+	}
+	ret = opts.dst_addr ? mt_tx_comp(t) : mt_rx_comp(t);
+	if (ret)
+		return ret;
+	ft_timer_gettime(&t->end);
+
+	return 0;
+}
+
+static void *mt_thread_run(void *arg)
+{
+	struct mt_thread *t = arg;
+	cpu_set_t cpuset;
+	int ret;
+
+	/* Without -C, spread the threads round-robin over all cpus */
+	if (opts.options & FT_OPT_CPU) {
+		ret = ft_pin_thread(t->id);
+		ret = ret < 0 ? ret : 0;
+	} else {
+		CPU_ZERO(&cpuset);
+		CPU_SET(t->cpu, &cpuset);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof cpuset,
+					     &cpuset);
+		if (ret)
+			FT_PRINTERR("pthread_setaffinity_np", -ret);
+		ret = 0;
+	}
+	ft_get_cpu(&t->cpu, &t->node);
+
+	pthread_barrier_wait(&barrier);
+	t->ret = ret ? ret : mt_bandwidth(t);
+	return NULL;
+}
+
+static int mt_alloc_thread(struct mt_thread *t)
+{
+	int ret;
+
+	ret = fi_av_open(domain, &av_attr, &t->av, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_av_open", ret);
+		return ret;
+	}
+
+	ret = ft_ctx_open(&t->ctx, ep_info, t->av, msg_size);
+	if (ret)
+		return ret;
+
+	t->ctx_arr = calloc(opts.window_size, sizeof(*t->ctx_arr));
+	if (!t->ctx_arr)
+		return -FI_ENOMEM;
+
+	t->namelen = sizeof t->name;
+	ret = fi_getname(&t->ctx.ep->fid, t->name, &t->namelen);
+	if (ret) {
+		FT_PRINTERR("fi_getname", ret);
+		return ret;
+	}
+
+	return opts.dst_addr ? ft_ctx_post_rx(&t->ctx, 4, &t->ack_ctx) : 0;
+}
+
+
+static void mt_free_res(void)
+{
+	int i;
+
+	if (!threads)
+		return;
+
+	for (i = 0; i < thread_cnt; i++) {
+		ft_ctx_close(&threads[i].ctx);
+		FT_CLOSE_FID(threads[i].av);
+		free(threads[i].ctx_arr);
+	}
+	free(threads);
+	threads = NULL;
+}
+
+static int mt_sock_xchg(void *local, void *remote, size_t len)
+{
+	int ret;
+
+	if (opts.dst_addr) {
+		ret = ft_sock_send(sock, local, len);
+		if (ret)
+			return ret;
+		ret = ft_sock_recv(sock, remote, len);
+	} else {
+		ret = ft_sock_recv(sock, remote, len);
+		if (ret)
+			return ret;
+		ret = ft_sock_send(sock, local, len);
+	}
+
+	return ret;
+}
+
+static int mt_init_threads(void)
+{
+	char name[FT_MAX_CTRL_MSG];
+	int i, ncpu, ret;
+
+	ret = mt_sock_xchg(&thread_cnt, &i, sizeof i);
+	if (ret)
+		return ret;
+
+	if (i != thread_cnt) {
+		FT_ERR("Thread count mismatch: local %d, peer %d\n",
+		       thread_cnt, i);
+		return -FI_EINVAL;
+	}
+
+	threads = calloc(thread_cnt, sizeof(*threads));
+	if (!threads)
+		return -FI_ENOMEM;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < thread_cnt; i++) {
+		threads[i].id = i;
+		threads[i].cpu = i % ncpu;
+		ret = mt_alloc_thread(&threads[i]);
+		if (ret)
+			return ret;
+
+		ret = mt_sock_xchg(threads[i].name, name, sizeof name);
+		if (ret)
+			return ret;
+
+		ret = ft_av_insert(threads[i].av, name, 1,
+				   &threads[i].ctx.peer_addr, 0, NULL);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void mt_show_perf(void)
+{
+	struct timespec first, last;
+	char name[FT_MAX_CTRL_MSG];
+	int i;
+
+	first = threads[0].start;
+	last = threads[0].end;
+	for (i = 0; i < thread_cnt; i++) {
+		snprintf(name, sizeof name, "thread %d (cpu %d, node %d)", i,
+			 threads[i].cpu, threads[i].node);
+		show_perf(name, opts.transfer_size, opts.iterations,
+			  &threads[i].start, &threads[i].end, 1);
+
+		if (get_elapsed(&threads[i].start, &first, NANO) > 0)
+			first = threads[i].start;
+		if (get_elapsed(&last, &threads[i].end, NANO) > 0)
+			last = threads[i].end;
+	}
+
+	snprintf(name, sizeof name, "all %d threads", thread_cnt);
+	show_perf(name, opts.transfer_size, opts.iterations * thread_cnt,
+		  &first, &last, 1);
+}
+
+static int mt_run(void)
+{
+	int i, ret;
+
+	/* Both sides have all threads idle before the next size starts. */
+	ret = ft_sock_sync(0);
+	if (ret)
+		return ret;
+
+	ret = pthread_barrier_init(&barrier, NULL, thread_cnt);
+	if (ret)
+		return -ret;
+
+	for (i = 0; i < thread_cnt; i++) {
+		ret = pthread_create(&threads[i].thread, NULL, mt_thread_run,
+				     &threads[i]);
+		if (ret) {
+			FT_PRINTERR("pthread_create", -ret);
+			/* threads already started will block on the barrier */
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < thread_cnt; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].ret && !ret)
+			ret = threads[i].ret;
+	}
+	pthread_barrier_destroy(&barrier);
+	if (ret)
+		return ret;
+
+	mt_show_perf();
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	/* Per-thread endpoints take ephemeral addresses. */
+	ep_info = fi_dupinfo(fi);
+	if (!ep_info)
+		return -FI_ENOMEM;
+	free(ep_info->src_addr);
+	free(ep_info->dest_addr);
+	ep_info->src_addr = ep_info->dest_addr = NULL;
+	ep_info->src_addrlen = ep_info->dest_addrlen = 0;
+
+	if (fi->domain_attr->av_type != FI_AV_UNSPEC)
+		av_attr.type = fi->domain_attr->av_type;
+
+	msg_size = opts.options & FT_OPT_SIZE ?
+		   opts.transfer_size : test_size[TEST_CNT - 1].size;
+	if (msg_size > fi->ep_attr->max_msg_size)
+		msg_size = fi->ep_attr->max_msg_size;
+
+	if (opts.dst_addr) {
+		ret = ft_sock_connect(opts.dst_addr, sock_service);
+		if (ret)
+			goto out;
+	} else {
+		ret = ft_sock_listen(sock_service);
+		if (ret)
+			goto out;
+		ret = ft_sock_accept();
+		if (ret)
+			goto out;
+	}
+
+	ret = mt_init_threads();
+	if (ret)
+		goto out;
+
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled) ||
+			    test_size[i].size > msg_size)
+				continue;
+			opts.transfer_size = test_size[i].size;
+			init_test(&opts, test_name, sizeof(test_name));
+			ret = mt_run();
+			if (ret)
+				goto out;
+		}
+	} else {
+		init_test(&opts, test_name, sizeof(test_name));
+		ret = mt_run();
+		if (ret)
+			goto out;
+	}
+
+	ret = ft_sock_sync(0);
+out:
+	if (sock >= 0)
+		ft_sock_shutdown(sock);
+	mt_free_res();
+	if (ep_info)
+		fi_freeinfo(ep_info);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_BW;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "n:q:h" CS_OPTS INFO_OPTS BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'n':
+			thread_cnt = atoi(optarg);
+			break;
+		case 'q':
+			sock_service = optarg;
+			break;
+		/* The per-thread window loop has none of these modes */
+		case 'A':
+		case 'D':
+		case 'H':
+		case 'i':
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test\n", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Multi-threaded message rate test for "
+					"RDM endpoints, one endpoint per thread.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-n <threads>", "number of threads "
+					"(default: 1)");
+			FT_PRINT_OPTS_USAGE("-q <service_port>", "management port");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (thread_cnt < 1) {
+		FT_ERR("Invalid thread count %d\n", thread_cnt);
+		return EXIT_FAILURE;
+	}
+
+	if (opts.comp_method != FT_COMP_SPIN) {
+		FT_ERR("Only spin completion polling is supported\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The -v and -V message counters are shared by all threads */
+	if ((opts.options & FT_OPT_VERIFY_DATA) && thread_cnt > 1) {
+		FT_ERR("Data verification requires a single thread\n");
+		return EXIT_FAILURE;
+	}
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->domain_attr->resource_mgmt = FI_RM_ENABLED;
+	/* Each thread serializes access to its own endpoint and CQs. */
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+	hints->caps = FI_MSG;
+	hints->mode = FI_LOCAL_MR | FI_CONTEXT;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
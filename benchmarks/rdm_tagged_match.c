@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_tagged.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Tag matching under load.  Before the measured pingpong and bandwidth
+ * runs, each side either posts depth decoy receives that no measured
+ * message matches, or sends the peer depth decoy messages that no measured
+ * receive matches, leaving them in its unexpected queue.  Decoy tags have
+ * MATCH_DECOY set, which sequence tags never reach, and decoy receives
+ * ignore the bits in the -g mask.  Afterwards the decoys are consumed by
+ * matching traffic, so every depth starts from empty queues.
+ */
+#define MATCH_DECOY	(1ULL << 48)
+
+static const int match_depths[] = { 0, 1, 4, 16, 64, 256, 1024 };
+
+#define MATCH_DEPTH_CNT (sizeof(match_depths) / sizeof(match_depths[0]))
+
+static int depth = -1;
+static uint64_t ignore;
+static int unexpected;
+static int max_depth;
+static struct fi_context *decoy_ctx;
+static char row_name[FT_MAX_CTRL_MSG];
+
+/*
+ * Decoy completions are reaped outside the tx_seq/rx_seq accounting, which
+ * keeps the tags of the measured messages in step on both sides.
+ */
+static int match_reap(uint64_t *cntr, int (*get_comp)(uint64_t), int cnt)
+{
+	int ret;
+
+	ret = get_comp(*cntr + cnt);
+	*cntr -= cnt;
+	return ret;
+}
+
+static int match_post_recv(int j)
+{
+	int ret;
+
+	ret = fi_trecv(ep, rx_buf, ft_rx_prefix_size(), fi_mr_desc(mr), 0,
+		       MATCH_DECOY | j, ignore, &decoy_ctx[j]);
+	if (ret)
+		FT_PRINTERR("fi_trecv", ret);
+	return ret;
+}
+
+static int match_send(int cnt)
+{
+	int j, ret;
+
+	for (j = 0; j < cnt; j++) {
+		do {
+			ret = fi_tsend(ep, tx_buf, ft_tx_prefix_size(),
+				       fi_mr_desc(mr), remote_fi_addr,
+				       MATCH_DECOY | j, &tx_ctx);
+		} while (ret == -FI_EAGAIN);
+		if (ret) {
+			FT_PRINTERR("fi_tsend", ret);
+			return ret;
+		}
+
+		ret = match_reap(&tx_cq_cntr, ft_get_tx_comp, 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int match_fill(int cnt)
+{
+	int j, ret;
+
+	if (unexpected)
+		return match_send(cnt);
+
+	for (j = 0; j < cnt; j++) {
+		ret = match_post_recv(j);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int match_drain(int cnt)
+{
+	int j, ret;
+
+	if (!unexpected) {
+		ret = match_send(cnt);
+		if (ret)
+			return ret;
+		return match_reap(&rx_cq_cntr, ft_get_rx_comp, cnt);
+	}
+
+	for (j = 0; j < cnt; j++) {
+		ret = match_post_recv(j);
+		if (ret)
+			return ret;
+		ret = match_reap(&rx_cq_cntr, ft_get_rx_comp, 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int match_run(int cnt)
+{
+	const char *mode = unexpected ? "unexpected" : "posted";
+	int ret;
+
+	ret = match_fill(cnt);
+	if (ret)
+		return ret;
+
+	opts.options &= ~FT_OPT_BW;
+	snprintf(row_name, sizeof row_name, "lat %s %d", mode, cnt);
+	ret = pingpong();
+	opts.options |= FT_OPT_BW;
+	if (ret)
+		return ret;
+
+	snprintf(row_name, sizeof row_name, "bw %s %d", mode, cnt);
+	ret = bandwidth();
+	if (ret)
+		return ret;
+
+	return match_drain(cnt);
+}
+
+static int match_run_depths(void)
+{
+	int i, ret;
+
+	if (depth >= 0)
+		return match_run(depth);
+
+	for (i = 0; i < MATCH_DEPTH_CNT; i++) {
+		if (match_depths[i] > max_depth)
+			break;
+		ret = match_run(match_depths[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_bw_init();
+	if (ret)
+		return ret;
+
+	/* Posted decoys share the receive queue with a window of receives */
+	max_depth = match_depths[MATCH_DEPTH_CNT - 1];
+	if (!unexpected && fi->rx_attr->size &&
+	    max_depth > (int) fi->rx_attr->size - opts.window_size - 1)
+		max_depth = fi->rx_attr->size - opts.window_size - 1;
+	if (depth > max_depth) {
+		FT_ERR("Depth %d exceeds the receive queue, at most %d\n",
+		       depth, max_depth);
+		return -FI_EINVAL;
+	}
+
+	decoy_ctx = calloc(MAX(depth, max_depth) + 1, sizeof(*decoy_ctx));
+	if (!decoy_ctx)
+		return -FI_ENOMEM;
+
+	bench_name = row_name;
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled))
+				continue;
+			opts.transfer_size = test_size[i].size;
+			init_test(&opts, test_name, sizeof(test_name));
+			ret = match_run_depths();
+			if (ret)
+				goto out;
+		}
+	} else {
+		init_test(&opts, test_name, sizeof(test_name));
+		ret = match_run_depths();
+		if (ret)
+			goto out;
+	}
+
+	ft_finalize();
+out:
+	bench_name = NULL;
+	free(decoy_ctx);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_BW;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "n:g:Uh" CS_OPTS INFO_OPTS BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'n':
+			if (strncasecmp("all", optarg, 3))
+				depth = atoi(optarg);
+			break;
+		case 'g':
+			if (!strncasecmp("all", optarg, 3))
+				ignore = MATCH_DECOY - 1;
+			else
+				ignore = strtoull(optarg, NULL, 0) &
+					 (MATCH_DECOY - 1);
+			break;
+		case 'U':
+			unexpected = 1;
+			break;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Tag matching latency and bandwidth "
+					"for RDM endpoints against a deep posted "
+					"receive or unexpected message queue.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-n <depth>", "decoy queue depth or "
+					"'all' (default: all)");
+			FT_PRINT_OPTS_USAGE("-g <mask>", "ignore mask of the "
+					"decoy receives, or 'all' for wildcards");
+			FT_PRINT_OPTS_USAGE("-U", "queue decoys as unexpected "
+					"messages instead of posted receives");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->domain_attr->resource_mgmt = FI_RM_ENABLED;
+	hints->caps = FI_TAGGED;
+	hints->mode = FI_LOCAL_MR | FI_CONTEXT;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
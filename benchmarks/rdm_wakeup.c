@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+/*
+ * Pingpong latency with the waiting side asleep in each blocking completion
+ * mechanism.  Every mechanism has its own endpoint context, whose CQs are
+ * bound to the matching wait object, and all contexts share one AV.  For
+ * each size the mechanisms run back to back after the spin baseline, and
+ * each row carries its median one-way penalty against spin.
+ */
+struct wk_method {
+	int comp_method;
+	const char *name;
+	struct ft_ctx ctx;
+	int opened;
+	int active;
+};
+
+static struct wk_method methods[] = {
+	{ .comp_method = FT_COMP_SPIN, .name = "spin" },
+	{ .comp_method = FT_COMP_SREAD, .name = "sread" },
+	{ .comp_method = FT_COMP_WAITSET, .name = "waitset" },
+	{ .comp_method = FT_COMP_POLLSET, .name = "pollset" },
+	{ .comp_method = FT_COMP_WAIT_FD, .name = "fd" },
+#if HAVE_EPOLL
+	{ .comp_method = FT_COMP_EPOLL, .name = "epoll" },
+#endif
+};
+
+#define WK_METHOD_CNT (sizeof(methods) / sizeof(methods[0]))
+
+static char *sock_service = "2710";
+static struct fi_info *ep_info;
+static size_t msg_size;
+static int method_set;
+static int method_sel;
+
+static int wk_sock_xchg(void *local, void *remote, size_t len)
+{
+	int ret;
+
+	if (opts.dst_addr) {
+		ret = ft_sock_send(sock, local, len);
+		if (ret)
+			return ret;
+		ret = ft_sock_recv(sock, remote, len);
+	} else {
+		ret = ft_sock_recv(sock, remote, len);
+		if (ret)
+			return ret;
+		ret = ft_sock_send(sock, local, len);
+	}
+
+	return ret;
+}
+
+/*
+ * A mechanism runs only if both sides could open its context; one the
+ * provider rejects is reported and skipped rather than failing the test.
+ */
+static int wk_open(struct wk_method *m)
+{
+	char name[FT_MAX_CTRL_MSG], peer_name[FT_MAX_CTRL_MSG];
+	size_t namelen = sizeof name;
+	int ok, peer_ok, ret;
+
+	opts.comp_method = m->comp_method;
+	m->opened = 1;
+	ret = ft_ctx_open(&m->ctx, ep_info, av, msg_size);
+	if (!ret)
+		ret = fi_getname(&m->ctx.ep->fid, name, &namelen);
+	if (!ret)
+		ret = ft_ctx_post_rx(&m->ctx, m->ctx.rx_msg_size, &m->ctx.rx_ctx);
+	opts.comp_method = FT_COMP_SPIN;
+
+	ok = !ret;
+	ret = wk_sock_xchg(&ok, &peer_ok, sizeof ok);
+	if (ret)
+		return ret;
+
+	if (!ok || !peer_ok) {
+		FT_WARN("%s: not supported %s, skipped", m->name,
+			ok ? "by peer" : "locally");
+		ft_ctx_close(&m->ctx);
+		m->opened = 0;
+		return 0;
+	}
+
+	ret = wk_sock_xchg(name, peer_name, sizeof name);
+	if (ret)
+		return ret;
+
+	ret = ft_av_insert(av, peer_name, 1, &m->ctx.peer_addr, 0, NULL);
+	if (ret)
+		return ret;
+
+	m->active = 1;
+	return 0;
+}
+
+static int wk_open_all(void)
+{
+	int i, ret;
+
+	for (i = 0; i < WK_METHOD_CNT; i++) {
+		if (method_set && methods[i].comp_method != FT_COMP_SPIN &&
+		    methods[i].comp_method != method_sel)
+			continue;
+
+		ret = wk_open(&methods[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void wk_close_all(void)
+{
+	int i;
+
+	for (i = 0; i < WK_METHOD_CNT; i++) {
+		if (methods[i].opened)
+			ft_ctx_close(&methods[i].ctx);
+		methods[i].opened = methods[i].active = 0;
+	}
+}
+
+static int wk_tx(struct ft_ctx *c)
+{
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		return ft_ctx_inject(c, opts.transfer_size);
+
+	return ft_ctx_tx(c, c->peer_addr, opts.transfer_size,
+			 &c->tx_ctx);
+}
+
+/* Round trips are stamped back to back, as in pingpong() */
+static int wk_pingpong(struct ft_ctx *c)
+{
+	int i, ret, warmup = opts.warmup_iterations;
+	uint64_t stamp = 0, now;
+
+	for (i = 0; i < opts.iterations + warmup; i++) {
+		if (i == warmup) {
+			ft_start();
+			stamp = ft_timer_ticks();
+		}
+
+		if (opts.dst_addr) {
+			ret = wk_tx(c);
+			if (!ret)
+				ret = ft_ctx_rx(c, opts.transfer_size);
+		} else {
+			ret = ft_ctx_rx(c, opts.transfer_size);
+			if (!ret)
+				ret = wk_tx(c);
+		}
+		if (ret)
+			return ret;
+
+		if (i >= warmup) {
+			now = ft_timer_ticks();
+			ft_hist_add(&lat_hist, ft_timer_ticks_to_ns(now - stamp));
+			stamp = now;
+		}
+	}
+	ft_stop();
+
+	return 0;
+}
+
+static int wk_run(void)
+{
+	char name[FT_MAX_CTRL_MSG];
+	double p50, spin_p50 = -1;
+	int i, ret;
+
+	for (i = 0; i < WK_METHOD_CNT; i++) {
+		if (!methods[i].active)
+			continue;
+
+		/* Both sides are idle before each mechanism starts */
+		ret = ft_sock_sync(0);
+		if (ret)
+			return ret;
+
+		opts.comp_method = methods[i].comp_method;
+		ft_hist_reset(&lat_hist);
+		ret = wk_pingpong(&methods[i].ctx);
+		if (ret)
+			return ret;
+
+		/* One-way usec, as in the latency columns */
+		p50 = ft_hist_percentile(&lat_hist, 50) / 2000.0;
+		if (methods[i].comp_method == FT_COMP_SPIN) {
+			spin_p50 = p50;
+			snprintf(name, sizeof name, "%s", methods[i].name);
+		} else if (spin_p50 >= 0) {
+			snprintf(name, sizeof name, "%s (%+.2f usec vs spin)",
+				 methods[i].name, p50 - spin_p50);
+		} else {
+			snprintf(name, sizeof name, "%s", methods[i].name);
+		}
+		show_perf(name, opts.transfer_size, opts.iterations, &start,
+			  &end, 2);
+		opts.comp_method = FT_COMP_SPIN;
+	}
+
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	/* The contexts take ephemeral addresses. */
+	ep_info = fi_dupinfo(fi);
+	if (!ep_info)
+		return -FI_ENOMEM;
+	free(ep_info->src_addr);
+	free(ep_info->dest_addr);
+	ep_info->src_addr = ep_info->dest_addr = NULL;
+	ep_info->src_addrlen = ep_info->dest_addrlen = 0;
+
+	if (fi->domain_attr->av_type != FI_AV_UNSPEC)
+		av_attr.type = fi->domain_attr->av_type;
+
+	ret = fi_av_open(domain, &av_attr, &av, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_av_open", ret);
+		return ret;
+	}
+
+	msg_size = opts.options & FT_OPT_SIZE ?
+		   opts.transfer_size : test_size[TEST_CNT - 1].size;
+	if (msg_size > fi->ep_attr->max_msg_size)
+		msg_size = fi->ep_attr->max_msg_size;
+
+	if (opts.dst_addr) {
+		ret = ft_sock_connect(opts.dst_addr, sock_service);
+		if (ret)
+			goto out;
+	} else {
+		ret = ft_sock_listen(sock_service);
+		if (ret)
+			goto out;
+		ret = ft_sock_accept();
+		if (ret)
+			goto out;
+	}
+
+	ret = wk_open_all();
+	if (ret)
+		goto out;
+
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled) ||
+			    test_size[i].size > msg_size)
+				continue;
+			opts.transfer_size = test_size[i].size;
+			init_test(&opts, test_name, sizeof(test_name));
+			ret = wk_run();
+			if (ret)
+				goto out;
+		}
+	} else {
+		init_test(&opts, test_name, sizeof(test_name));
+		ret = wk_run();
+		if (ret)
+			goto out;
+	}
+
+	ret = ft_sock_sync(0);
+out:
+	if (sock >= 0)
+		ft_sock_shutdown(sock);
+	wk_close_all();
+	if (ep_info)
+		fi_freeinfo(ep_info);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_LAT_HIST;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "q:h" CS_OPTS INFO_OPTS BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'q':
+			sock_service = optarg;
+			break;
+		case 'c':
+			method_set = 1;
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		/* wk_pingpong() does not run through bench_run() */
+		case 'A':
+		case 'D':
+		case 'i':
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'v':
+		case 'V':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test\n", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Pingpong latency of RDM endpoints "
+					"waiting in each blocking completion "
+					"mechanism, against spinning.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-q <service_port>", "management port");
+			FT_PRINT_OPTS_USAGE("", "-c runs only the given mechanism "
+					"beside spin");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (opts.comp_method == FT_COMP_HYBRID) {
+		FT_ERR("hybrid is not a blocking completion mechanism\n");
+		return EXIT_FAILURE;
+	}
+	method_sel = opts.comp_method;
+	opts.comp_method = FT_COMP_SPIN;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_LOCAL_MR | FI_CONTEXT;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AWV
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+static struct fi_rma_iov remote;
+static int inject;
+
+static int run_size(void)
+{
+	init_test(&opts, test_name, sizeof(test_name));
+	return pingpong_rma(opts.rma_op, &remote, inject);
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	if (hints->ep_attr->type == FI_EP_MSG) {
+		if (!opts.dst_addr) {
+			ret = ft_start_server();
+			if (ret)
+				return ret;
+		}
+
+		ret = opts.dst_addr ? ft_client_connect() : ft_server_connect();
+	} else {
+		ret = ft_init_fabric();
+	}
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	if (!(opts.options & FT_OPT_SIZE)) {
+		for (i = 0; i < TEST_CNT; i++) {
+			if (!ft_use_size(i, opts.sizes_enabled))
+				continue;
+			if (inject && test_size[i].size > fi->tx_attr->inject_size)
+				continue;
+			opts.transfer_size = test_size[i].size;
+			ret = run_size();
+			if (ret)
+				goto out;
+		}
+	} else {
+		if (inject && opts.transfer_size > fi->tx_attr->inject_size) {
+			FT_ERR("Size exceeds inject size %zu\n",
+			       fi->tx_attr->inject_size);
+			ret = -FI_EINVAL;
+			goto out;
+		}
+		ret = run_size();
+		if (ret)
+			goto out;
+	}
+
+	ft_finalize();
+out:
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.rma_op = FT_RMA_WRITE;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "ho:" CS_OPTS INFO_OPTS BENCHMARK_OPTS)) != -1) {
+		switch (op) {
+		case 'o':
+			if (!strcmp(optarg, "inject_write")) {
+				opts.rma_op = FT_RMA_WRITE;
+				inject = 1;
+				break;
+			}
+			if (ft_parse_rma_opts(op, optarg, &opts) ||
+			    opts.rma_op == FT_RMA_READ) {
+				FT_ERR("Invalid operation type: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			inject = 0;
+			break;
+		/* The flag-polling loop has none of these modes */
+		case 'Q':
+		case 'R':
+		case 'u':
+		case 'v':
+		case 'V':
+		case 'Z':
+			FT_ERR("Option -%c is not supported by this test\n", op);
+			return EXIT_FAILURE;
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Ping pong test using RMA writes, "
+					"polling memory for the peer's write.");
+			ft_benchmark_usage();
+			FT_PRINT_OPTS_USAGE("-o <op>", "rma op type: inject_write|"
+					"write|writedata (default: write)\n");
+			fprintf(stderr, "Note: writedata waits for the remote CQ "
+					"data completion instead of polling "
+					"memory.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	hints->caps = FI_MSG | FI_RMA;
+	hints->domain_attr->resource_mgmt = FI_RM_ENABLED;
+	hints->mode = FI_LOCAL_MR | FI_RX_CQ_DATA;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
@@ -31,10 +31,16 @@
 #include <assert.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 
@@ -47,15 +53,30 @@
 
 #include <shared.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define FT_HAVE_SIMD 1
+#include <immintrin.h>
+#else
+#define FT_HAVE_SIMD 0
+#endif
+
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if HAVE_PERF_EVENT
+#include <linux/perf_event.h>
+#endif
+
+#if FT_HAVE_TSC
+#include <cpuid.h>
+#endif
+
 struct fi_info *fi_pep, *fi, *hints;
 struct fid_fabric *fabric;
-struct fid_wait *waitset;
 struct fid_domain *domain;
-struct fid_poll *pollset;
 struct fid_pep *pep;
 struct fid_ep *ep, *alias_ep;
-struct fid_cq *txcq, *rxcq;
-struct fid_cntr *txcntr, *rxcntr;
 struct fid_mr *mr;
 struct fid_av *av;
 struct fid_eq *eq;
@@ -63,23 +84,56 @@ struct fid_eq *eq;
 struct fid_mr no_mr;
 struct fi_context tx_ctx, rx_ctx;
 struct fi_context *tx_ctx_arr = NULL, *rx_ctx_arr = NULL;
+struct ft_pool ft_pool;
+static size_t buf_map_size;
+static enum ft_mem_type buf_mem_type;
+static int buf_mem_node = -1;
+static int ft_cpus[CPU_SETSIZE];
+static int ft_cpu_cnt;
 uint64_t remote_cq_data = 0;
+struct ft_comp_stats ft_comp_stats;
+struct ft_verify_stats ft_verify_stats;
+unsigned int ft_csum_gen;
+struct ft_rusage ft_rusage;
+static struct rusage ft_rusage_ru;
+
+static void ft_csum_fence(const void *buf, size_t len);
+static int ft_csum_drain(void);
+static void ft_csum_stop(void);
 
-uint64_t tx_seq, rx_seq, tx_cq_cntr, rx_cq_cntr;
 int ft_skip_mr = 0;
 int ft_parent_proc = 0;
 pid_t ft_child_pid = 0;
 int ft_socket_pair[2];
+int ft_child_id = -1;
+static int ft_child_cnt;
+static pid_t *ft_child_pids;
+static int (*ft_child_pairs)[2];
+
+/* Storage of the classic data path globals, see shared.h */
+struct ft_ctx ft_default_ctx = {
+	.tx_wait_fd = -1,
+	.rx_wait_fd = -1,
+	.epoll_fd = -1,
+	.peer_addr = FI_ADDR_UNSPEC,
+};
+#define epfd		ft_default_ctx.epoll_fd
 
-fi_addr_t remote_fi_addr = FI_ADDR_UNSPEC;
-char *buf, *tx_buf, *rx_buf;
-size_t buf_size, tx_size, rx_size;
-int rx_fd = -1, tx_fd = -1;
+char *buf;
+size_t buf_size, tx_size;
 char default_port[8] = "9228";
 
 char test_name[50] = "custom";
 int timeout = -1;
 struct timespec start, end;
+struct ft_hist lat_hist;
+struct ft_hist res_hist;
+struct ft_op_pool ft_op_pool;
+
+struct ft_timer ft_timer = {
+	.src = FT_TIMER_CLOCK,
+	.nsec_per_tick = 1.0,
+};
 
 int listen_sock = -1;
 int sock = -1;
@@ -130,6 +184,7 @@ struct test_size_param test_size[] = {
 const unsigned int test_cnt = (sizeof test_size / sizeof test_size[0]);
 
 #define INTEG_SEED 7
+#define FT_TSC_CALIBRATE_NSEC	(20 * 1000 * 1000)
 static const char integ_alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
 static const int integ_alphabet_length = (sizeof(integ_alphabet)/sizeof(*integ_alphabet)) - 1;
 
@@ -178,12 +233,13 @@ static void ft_cq_set_wait_attr(void)
 		cq_attr.wait_cond = FI_CQ_COND_NONE;
 		break;
 	case FT_COMP_WAITSET:
-		assert(waitset);
 		cq_attr.wait_obj = FI_WAIT_SET;
 		cq_attr.wait_cond = FI_CQ_COND_NONE;
 		cq_attr.wait_set = waitset;
 		break;
 	case FT_COMP_WAIT_FD:
+	case FT_COMP_HYBRID:
+	case FT_COMP_EPOLL:
 		cq_attr.wait_obj = FI_WAIT_FD;
 		cq_attr.wait_cond = FI_CQ_COND_NONE;
 		break;
@@ -204,6 +260,8 @@ static void ft_cntr_set_wait_attr(void)
 		cntr_attr.wait_obj = FI_WAIT_SET;
 		break;
 	case FT_COMP_WAIT_FD:
+	case FT_COMP_HYBRID:
+	case FT_COMP_EPOLL:
 		cntr_attr.wait_obj = FI_WAIT_FD;
 		break;
 	default:
@@ -212,6 +270,85 @@ static void ft_cntr_set_wait_attr(void)
 	}
 }
 
+static int ft_open_waitset(struct fid_wait **wait)
+{
+	struct fi_wait_attr wait_attr;
+	int ret;
+
+	memset(&wait_attr, 0, sizeof wait_attr);
+	wait_attr.wait_obj = FI_WAIT_UNSPEC;
+	ret = fi_wait_open(fabric, &wait_attr, wait);
+	if (ret)
+		FT_PRINTERR("fi_wait_open", ret);
+	return ret;
+}
+
+/*
+ * FT_COMP_POLLSET and FT_COMP_EPOLL wait on a pair of CQs through one
+ * pollset or epoll set, which is opened here once the CQs and their wait
+ * fds exist.
+ */
+static int ft_open_cq_set(struct fid_cq *tcq, struct fid_cq *rcq,
+			  int tfd, int rfd, struct fid_poll **pset, int *efd)
+{
+	struct fid_cq *cqs[2] = { tcq, rcq };
+	struct fi_poll_attr poll_attr;
+#if HAVE_EPOLL
+	struct epoll_event event;
+	int fds[2] = { tfd, rfd };
+#endif
+	int i, ret;
+
+	switch (opts.comp_method) {
+	case FT_COMP_POLLSET:
+		memset(&poll_attr, 0, sizeof poll_attr);
+		ret = fi_poll_open(domain, &poll_attr, pset);
+		if (ret) {
+			FT_PRINTERR("fi_poll_open", ret);
+			return ret;
+		}
+		for (i = 0; i < 2; i++) {
+			if (!cqs[i])
+				continue;
+			ret = fi_poll_add(*pset, &cqs[i]->fid, 0);
+			if (ret) {
+				FT_PRINTERR("fi_poll_add", ret);
+				return ret;
+			}
+		}
+		break;
+	case FT_COMP_EPOLL:
+#if HAVE_EPOLL
+		*efd = epoll_create1(0);
+		if (*efd < 0) {
+			ret = -errno;
+			FT_PRINTERR("epoll_create1", ret);
+			return ret;
+		}
+		for (i = 0; i < 2; i++) {
+			if (!cqs[i])
+				continue;
+			memset(&event, 0, sizeof event);
+			event.events = EPOLLIN;
+			event.data.ptr = cqs[i];
+			if (epoll_ctl(*efd, EPOLL_CTL_ADD, fds[i], &event)) {
+				ret = -errno;
+				FT_PRINTERR("epoll_ctl", ret);
+				return ret;
+			}
+		}
+		break;
+#else
+		FT_ERR("epoll is not supported on this system");
+		return -FI_ENOSYS;
+#endif
+	default:
+		break;
+	}
+
+	return 0;
+}
+
 static uint64_t ft_caps_to_mr_access(uint64_t caps)
 {
 	uint64_t mr_access = 0;
@@ -233,15 +370,224 @@ static uint64_t ft_caps_to_mr_access(uint64_t caps)
 	return mr_access;
 }
 
+#define FT_CACHE_LINE_SIZE	64
+#define FT_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#define FT_ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* From linux/mempolicy.h; called through syscall() to avoid libnuma */
+#define FT_MPOL_BIND		2
+#define FT_MPOL_F_NODE		(1 << 0)
+#define FT_MPOL_F_ADDR		(1 << 1)
+#define FT_MPOL_MF_STRICT	(1 << 0)
+#define FT_MPOL_MF_MOVE		(1 << 1)
+
+static void ft_free_region(void *ptr);
+
+static int ft_mbind(void *addr, size_t len, int node)
+{
+	unsigned long mask[4] = { 0 };
+	int ret;
+
+	if (node < 0 || node >= (int) (sizeof mask * 8)) {
+		FT_ERR("Invalid NUMA node %d\n", node);
+		return -FI_EINVAL;
+	}
+
+	mask[node / (sizeof *mask * 8)] = 1UL << (node % (sizeof *mask * 8));
+	ret = syscall(SYS_mbind, addr, len, FT_MPOL_BIND, mask,
+		      sizeof mask * 8, FT_MPOL_MF_MOVE | FT_MPOL_MF_STRICT);
+	if (ret) {
+		perror("mbind");
+		return -errno;
+	}
+	return 0;
+}
+
+/* NUMA node holding the page at addr, which must already be faulted in */
+static int ft_mem_node(void *addr)
+{
+	int node = -1;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+		    FT_MPOL_F_NODE | FT_MPOL_F_ADDR))
+		return -1;
+	return node;
+}
+
+static const char *ft_mem_type_str(enum ft_mem_type type)
+{
+	switch (type) {
+	case FT_MEM_HUGETLB:
+		return "hugetlb";
+	case FT_MEM_THP:
+		return "thp";
+	default:
+		return "default";
+	}
+}
+
+/* Parse a cpu list such as "0,2,4-7".  Returns the number of cpus. */
+int ft_parse_cpu_list(const char *str)
+{
+	char *end;
+	long lo, hi;
+
+	ft_cpu_cnt = 0;
+	do {
+		lo = strtol(str, &end, 10);
+		if (end == str || lo < 0 || lo >= CPU_SETSIZE)
+			return -FI_EINVAL;
+		hi = lo;
+		if (*end == '-') {
+			str = end + 1;
+			hi = strtol(str, &end, 10);
+			if (end == str || hi < lo || hi >= CPU_SETSIZE)
+				return -FI_EINVAL;
+		}
+		for (; lo <= hi && ft_cpu_cnt < CPU_SETSIZE; lo++)
+			ft_cpus[ft_cpu_cnt++] = lo;
+		str = end + 1;
+	} while (*end == ',');
+
+	return *end ? -FI_EINVAL : ft_cpu_cnt;
+}
+
+/*
+ * Pin the calling thread to its cpu from the -C list and check that the
+ * kernel honored it; cpusets and offline cores can silently narrow the
+ * mask.  Returns the cpu, or 0 if no list was given.
+ */
+int ft_pin_thread(int idx)
+{
+	cpu_set_t set;
+	int cpu, ret;
+
+	if (!ft_cpu_cnt)
+		return 0;
+
+	cpu = ft_cpus[idx % ft_cpu_cnt];
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof set, &set)) {
+		ret = -errno;
+		FT_PRINTERR("sched_setaffinity", ret);
+		return ret;
+	}
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof set, &set)) {
+		ret = -errno;
+		FT_PRINTERR("sched_getaffinity", ret);
+		return ret;
+	}
+
+	if (CPU_COUNT(&set) != 1 || !CPU_ISSET(cpu, &set) ||
+	    sched_getcpu() != cpu) {
+		FT_ERR("Unable to pin thread %d to cpu %d\n", idx, cpu);
+		return -FI_EINVAL;
+	}
+	return cpu;
+}
+
+/* Current cpu and its NUMA node for the calling thread */
+void ft_get_cpu(int *cpu, int *node)
+{
+	unsigned c, n;
+
+	if (syscall(SYS_getcpu, &c, &n, NULL)) {
+		*cpu = *node = -1;
+		return;
+	}
+	*cpu = c;
+	*node = n;
+}
+
+/*
+ * Allocate size bytes aligned to alignment.  Hugepage backed memory is
+ * mapped directly and falls back to the heap if no hugepages are free.
+ * Transparent hugepages are requested with madvise on 2 MiB aligned heap
+ * memory.  With FT_OPT_NUMA the region is bound to opts.numa_node before it
+ * is touched.  buf_mem_type records what was actually obtained.
+ */
+static int ft_alloc_region(void **ptr, size_t size, size_t alignment)
+{
+	int ret;
+
+	buf_mem_type = FT_MEM_DEFAULT;
+	if (opts.mem_type == FT_MEM_HUGETLB) {
+		buf_map_size = FT_ALIGN_UP(size, FT_HUGEPAGE_SIZE);
+		*ptr = mmap(NULL, buf_map_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (*ptr != MAP_FAILED) {
+			buf_mem_type = FT_MEM_HUGETLB;
+			goto bind;
+		}
+
+		perror("mmap MAP_HUGETLB, using regular pages");
+		buf_map_size = 0;
+	} else if (opts.mem_type == FT_MEM_THP) {
+		alignment = FT_HUGEPAGE_SIZE;
+		size = FT_ALIGN_UP(size, FT_HUGEPAGE_SIZE);
+	}
+
+	if ((opts.options & FT_OPT_NUMA) &&
+	    alignment < (size_t) sysconf(_SC_PAGESIZE))
+		alignment = sysconf(_SC_PAGESIZE);
+
+	if (alignment > 1) {
+		ret = posix_memalign(ptr, alignment, size);
+		if (ret) {
+			FT_PRINTERR("posix_memalign", ret);
+			return ret;
+		}
+	} else {
+		*ptr = malloc(size);
+		if (!*ptr) {
+			perror("malloc");
+			return -FI_ENOMEM;
+		}
+	}
+
+	if (opts.mem_type == FT_MEM_THP) {
+		if (madvise(*ptr, size, MADV_HUGEPAGE))
+			perror("madvise MADV_HUGEPAGE, using regular pages");
+		else
+			buf_mem_type = FT_MEM_THP;
+	}
+
+bind:
+	if (opts.options & FT_OPT_NUMA) {
+		ret = ft_mbind(*ptr, size, opts.numa_node);
+		if (ret) {
+			ft_free_region(*ptr);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void ft_free_region(void *ptr)
+{
+	if (buf_map_size) {
+		munmap(ptr, buf_map_size);
+		buf_map_size = 0;
+	} else {
+		free(ptr);
+	}
+}
+
 /*
  * Include FI_MSG_PREFIX space in the allocated buffer, and ensure that the
  * buffer is large enough for a control message used to exchange addressing
- * data.
+ * data.  With FT_OPT_POOL, window_size transmit and receive slots follow
+ * tx_buf.  Slots are cache line aligned, or page aligned once a slot spans a
+ * page, and the whole region is registered once.
  */
 int ft_alloc_msgs(void)
 {
 	int ret;
 	long alignment = 1;
+	size_t pool_size = 0;
 
 	/* TODO: support multi-recv tests */
 	if (fi->rx_attr->op_flags == FI_MULTI_RECV)
@@ -255,31 +601,45 @@ int ft_alloc_msgs(void)
 	tx_size += ft_tx_prefix_size();
 	buf_size = MAX(tx_size, FT_MAX_CTRL_MSG) + MAX(rx_size, FT_MAX_CTRL_MSG);
 
-	if (opts.options & FT_OPT_ALIGN) {
+	if (opts.options & (FT_OPT_ALIGN | FT_OPT_POOL)) {
 		alignment = sysconf(_SC_PAGESIZE);
 		if (alignment < 0)
 			return -errno;
 		buf_size += alignment;
+	}
 
-		ret = posix_memalign((void **) &buf, (size_t) alignment,
-				buf_size);
-		if (ret) {
-			FT_PRINTERR("posix_memalign", ret);
-			return ret;
-		}
-	} else {
-		buf = malloc(buf_size);
-		if (!buf) {
-			perror("malloc");
-			return -FI_ENOMEM;
-		}
+	memset(&ft_pool, 0, sizeof ft_pool);
+	if ((opts.options & FT_OPT_POOL) && opts.window_size > 0) {
+		ft_pool.slot_cnt = opts.window_size;
+		ft_pool.slot_size = FT_ALIGN_UP(MAX(MAX(tx_size, rx_size),
+				FT_MAX_CTRL_MSG + ft_rx_prefix_size()),
+				FT_CACHE_LINE_SIZE);
+		if (ft_pool.slot_size >= alignment)
+			ft_pool.slot_size = FT_ALIGN_UP(ft_pool.slot_size,
+							alignment);
+		pool_size = ft_pool.slot_size * ft_pool.slot_cnt * 2;
+		buf_size += pool_size + alignment;
+	}
+
+	ret = ft_alloc_region((void **) &buf, buf_size, alignment);
+	if (ret) {
+		ft_pool.slot_cnt = 0;
+		return ret;
 	}
 	memset(buf, 0, buf_size);
+	buf_mem_node = ft_mem_node(buf);
 	rx_buf = buf;
 	tx_buf = (char *) buf + MAX(rx_size, FT_MAX_CTRL_MSG);
 	tx_buf = (void *) (((uintptr_t) tx_buf + alignment - 1) &
 			   ~(alignment - 1));
 
+	if (pool_size) {
+		ft_pool.tx_base = (char *) FT_ALIGN_UP((uintptr_t) tx_buf +
+				MAX(tx_size, FT_MAX_CTRL_MSG), alignment);
+		ft_pool.rx_base = ft_pool.tx_base +
+				  ft_pool.slot_size * ft_pool.slot_cnt;
+	}
+
 	remote_cq_data = ft_init_cq_data(fi);
 
 	if (!ft_skip_mr && ((fi->mode & FI_LOCAL_MR) ||
@@ -343,6 +703,12 @@ int ft_alloc_ep_res(struct fi_info *fi)
 			cq_attr.format = FI_CQ_FORMAT_CONTEXT;
 	}
 
+	if (opts.comp_method == FT_COMP_WAITSET && !waitset) {
+		ret = ft_open_waitset(&waitset);
+		if (ret)
+			return ret;
+	}
+
 	if (opts.options & FT_OPT_TX_CQ) {
 		ft_cq_set_wait_attr();
 		cq_attr.size = fi->tx_attr->size;
@@ -641,7 +1007,9 @@ int ft_get_cq_fd(struct fid_cq *cq, int *fd)
 {
 	int ret = FI_SUCCESS;
 
-	if (cq && opts.comp_method == FT_COMP_WAIT_FD) {
+	if (cq && (opts.comp_method == FT_COMP_WAIT_FD ||
+		   opts.comp_method == FT_COMP_HYBRID ||
+		   opts.comp_method == FT_COMP_EPOLL)) {
 		ret = fi_control(&cq->fid, FI_GETWAIT, fd);
 		if (ret)
 			FT_PRINTERR("fi_control(FI_GETWAIT)", ret);
@@ -668,7 +1036,8 @@ int ft_init_ep(void)
 	if (fi->ep_attr->type == FI_EP_MSG)
 		FT_EP_BIND(ep, eq, 0);
 	FT_EP_BIND(ep, av, 0);
-	FT_EP_BIND(ep, txcq, FI_TRANSMIT);
+	FT_EP_BIND(ep, txcq, FI_TRANSMIT | (opts.options & FT_OPT_SELECTIVE ?
+					    FI_SELECTIVE_COMPLETION : 0));
 	FT_EP_BIND(ep, rxcq, FI_RECV);
 
 	ret = ft_get_cq_fd(txcq, &tx_fd);
@@ -679,6 +1048,12 @@ int ft_init_ep(void)
 	if (ret)
 		return ret;
 
+	if (!pollset && epfd < 0) {
+		ret = ft_open_cq_set(txcq, rxcq, tx_fd, rx_fd, &pollset, &epfd);
+		if (ret)
+			return ret;
+	}
+
 	/* TODO: use control structure to select counter bindings explicitly */
 	flags = !txcq ? FI_SEND : 0;
 	if (hints->caps & (FI_WRITE | FI_READ))
@@ -826,21 +1201,29 @@ static void ft_close_fids(void)
 	FT_CLOSE_FID(domain);
 	FT_CLOSE_FID(waitset);
 	FT_CLOSE_FID(fabric);
+	if (epfd >= 0) {
+		close(epfd);
+		epfd = -1;
+	}
 }
 
 void ft_free_res(void)
 {
+	ft_csum_stop();
 	ft_close_fids();
 
 	free(tx_ctx_arr);
 	free(rx_ctx_arr);
 	tx_ctx_arr = NULL;
 	rx_ctx_arr = NULL;
+	free(ft_op_pool.op);
+	memset(&ft_op_pool, 0, sizeof ft_op_pool);
 
 	if (buf) {
-		free(buf);
+		ft_free_region(buf);
 		buf = rx_buf = tx_buf = NULL;
 		buf_size = rx_size = tx_size = 0;
+		memset(&ft_pool, 0, sizeof ft_pool);
 	}
 	if (fi_pep) {
 		fi_freeinfo(fi_pep);
@@ -996,6 +1379,8 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 {
 	char sstr[FT_STR_LEN];
 
+	ft_timer_init();
+
 	size_str(sstr, opts->transfer_size);
 	if (!strcmp(test_name, "custom"))
 		snprintf(test_name, test_name_len, "%s_lat", sstr);
@@ -1003,9 +1388,12 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 		opts->iterations = size_to_count(opts->transfer_size);
 }
 
-#define FT_POST(post_fn, comp_fn, seq, op_str, ...)				\
+/*
+ * Retry a post while it returns -FI_EAGAIN, reaping completions with comp
+ * in between.  Receive completions are reaped with a timeout of 0.
+ */
+#define FT_POST(post_fn, comp, seq, op_str, ...)				\
 	do {									\
-		int timeout_save;						\
 		int ret, rc;							\
 										\
 		while (1) {							\
@@ -1018,96 +1406,249 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 				return ret;					\
 			}							\
 										\
-			timeout_save = timeout;					\
-			timeout = 0;						\
-			rc = comp_fn(seq);					\
+			rc = comp;						\
 			if (rc && rc != -FI_EAGAIN) {				\
 				FT_ERR("Failed to get " op_str " completion");	\
 				return rc;					\
 			}							\
-			timeout = timeout_save;					\
 		}								\
 		seq++;								\
 	} while (0)
 
-ssize_t ft_post_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context* ctx)
+static int ft_ctx_rx_comp(struct ft_ctx *c, uint64_t total, int timeout);
+
+/*
+ * Open a context's CQs and endpoint on the global domain, bound to av,
+ * with page aligned tx and rx buffers for messages of up to size bytes.
+ * Posting the first receive is left to the caller.
+ */
+int ft_ctx_open(struct ft_ctx *c, struct fi_info *info, struct fid_av *av,
+		size_t size)
+{
+	static uint64_t key = FT_MR_KEY + 1;
+	struct fi_cq_attr attr;
+	size_t len;
+	int ret;
+
+	memset(c, 0, sizeof *c);
+	c->comp_method = opts.comp_method;
+	c->tx_wait_fd = c->rx_wait_fd = c->epoll_fd = -1;
+	c->peer_addr = FI_ADDR_UNSPEC;
+	c->mr = &no_mr;
+
+	if (c->comp_method == FT_COMP_WAITSET) {
+		ret = ft_open_waitset(&c->wait_set);
+		if (ret)
+			return ret;
+	}
+
+	ft_cq_set_wait_attr();
+	attr = cq_attr;
+	attr.wait_set = c->wait_set;
+	if (attr.format == FI_CQ_FORMAT_UNSPEC)
+		attr.format = info->caps & FI_TAGGED ?
+			      FI_CQ_FORMAT_TAGGED : FI_CQ_FORMAT_CONTEXT;
+
+	attr.size = info->tx_attr->size;
+	ret = fi_cq_open(domain, &attr, &c->tx_cq, &c->tx_cq);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	attr.size = info->rx_attr->size;
+	ret = fi_cq_open(domain, &attr, &c->rx_cq, &c->rx_cq);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	ret = fi_endpoint(domain, info, &c->ep, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	FT_EP_BIND(c->ep, av, 0);
+	FT_EP_BIND(c->ep, c->tx_cq, FI_TRANSMIT);
+	FT_EP_BIND(c->ep, c->rx_cq, FI_RECV);
+
+	ret = fi_enable(c->ep);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+
+	ret = ft_get_cq_fd(c->tx_cq, &c->tx_wait_fd);
+	if (ret)
+		return ret;
+
+	ret = ft_get_cq_fd(c->rx_cq, &c->rx_wait_fd);
+	if (ret)
+		return ret;
+
+	ret = ft_open_cq_set(c->tx_cq, c->rx_cq, c->tx_wait_fd, c->rx_wait_fd,
+			     &c->poll_set, &c->epoll_fd);
+	if (ret)
+		return ret;
+
+	/* Page align the buffers so that contexts never share a cache line */
+	len = MAX(size, FT_MAX_CTRL_MSG) +
+	      MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	ret = posix_memalign((void **) &c->buf, sysconf(_SC_PAGESIZE), len * 2);
+	if (ret) {
+		FT_PRINTERR("posix_memalign", -ret);
+		return -ret;
+	}
+	memset(c->buf, 0, len * 2);
+	c->rx_msg = c->buf;
+	c->tx_msg = c->buf + len;
+	c->rx_msg_size = size;
+
+	if (!ft_skip_mr && (info->mode & FI_LOCAL_MR)) {
+		ret = fi_mr_reg(domain, c->buf, len * 2, FT_MSG_MR_ACCESS, 0,
+				key++, 0, &c->mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void ft_ctx_close(struct ft_ctx *c)
+{
+	FT_CLOSE_FID(c->ep);
+	if (c->mr != &no_mr)
+		FT_CLOSE_FID(c->mr);
+	FT_CLOSE_FID(c->poll_set);
+	FT_CLOSE_FID(c->rx_cq);
+	FT_CLOSE_FID(c->tx_cq);
+	FT_CLOSE_FID(c->wait_set);
+	if (c->epoll_fd >= 0) {
+		close(c->epoll_fd);
+		c->epoll_fd = -1;
+	}
+	free(c->buf);
+	c->buf = c->tx_msg = c->rx_msg = NULL;
+}
+
+ssize_t ft_ctx_post_tx_buf(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx, void *buf)
 {
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_tsend, ft_get_tx_comp, tx_seq, "transmit", ep,
-				tx_buf, size + ft_tx_prefix_size(), fi_mr_desc(mr),
-				fi_addr, tx_seq, ctx);
+		FT_POST(fi_tsend, ft_ctx_get_tx_comp(c, c->tx_posted), c->tx_posted,
+				"transmit", c->ep, buf,
+				size + ft_tx_prefix_size(), fi_mr_desc(c->mr),
+				fi_addr, c->tx_posted, ctx);
 	} else {
-		FT_POST(fi_send, ft_get_tx_comp, tx_seq, "transmit", ep,
-				tx_buf,	size + ft_tx_prefix_size(), fi_mr_desc(mr),
+		FT_POST(fi_send, ft_ctx_get_tx_comp(c, c->tx_posted), c->tx_posted,
+				"transmit", c->ep, buf,
+				size + ft_tx_prefix_size(), fi_mr_desc(c->mr),
 				fi_addr, ctx);
 	}
 	return 0;
 }
 
-ssize_t ft_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context *ctx)
+ssize_t ft_ctx_post_tx(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx)
+{
+	return ft_ctx_post_tx_buf(c, fi_addr, size, ctx, c->tx_msg);
+}
+
+ssize_t ft_ctx_tx(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx)
 {
 	ssize_t ret;
 
 	if (ft_check_opts(FT_OPT_VERIFY_DATA | FT_OPT_ACTIVE))
-		ft_fill_buf((char *) tx_buf + ft_tx_prefix_size(), size);
+		ft_fill_buf((char *) c->tx_msg + ft_tx_prefix_size(), size);
 
-	ret = ft_post_tx(ep, fi_addr, size, ctx);
+	ret = ft_ctx_post_tx(c, fi_addr, size, ctx);
 	if (ret)
 		return ret;
 
-	ret = ft_get_tx_comp(tx_seq);
-	return ret;
+	return ft_ctx_get_tx_comp(c, c->tx_posted);
 }
 
-ssize_t ft_post_inject(struct fid_ep *ep, size_t size)
+ssize_t ft_ctx_post_inject_buf(struct ft_ctx *c, size_t size, void *buf)
 {
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_tinject, ft_get_tx_comp, tx_seq, "inject",
-				ep, tx_buf, size + ft_tx_prefix_size(),
-				remote_fi_addr, tx_seq);
+		FT_POST(fi_tinject, ft_ctx_get_tx_comp(c, c->tx_posted), c->tx_posted,
+				"inject", c->ep, buf,
+				size + ft_tx_prefix_size(), c->peer_addr,
+				c->tx_posted);
 	} else {
-		FT_POST(fi_inject, ft_get_tx_comp, tx_seq, "inject",
-				ep, tx_buf, size + ft_tx_prefix_size(),
-				remote_fi_addr);
+		FT_POST(fi_inject, ft_ctx_get_tx_comp(c, c->tx_posted), c->tx_posted,
+				"inject", c->ep, buf,
+				size + ft_tx_prefix_size(), c->peer_addr);
 	}
 
-	tx_cq_cntr++;
+	c->tx_completed++;
 	return 0;
 }
 
-ssize_t ft_inject(struct fid_ep *ep, size_t size)
+ssize_t ft_ctx_inject(struct ft_ctx *c, size_t size)
 {
-	ssize_t ret;
-
 	if (ft_check_opts(FT_OPT_VERIFY_DATA | FT_OPT_ACTIVE))
-		ft_fill_buf((char *) tx_buf + ft_tx_prefix_size(), size);
+		ft_fill_buf((char *) c->tx_msg + ft_tx_prefix_size(), size);
 
-	ret = ft_post_inject(ep, size);
-	if (ret)
-		return ret;
+	return ft_ctx_post_inject_buf(c, size, c->tx_msg);
+}
 
-	return ret;
+ssize_t ft_post_tx_buf(struct fid_ep *ep, fi_addr_t fi_addr, size_t size,
+		struct fi_context* ctx, void *buf)
+{
+	return ft_ctx_post_tx_buf(ft_ctx_default(ep), fi_addr, size, ctx, buf);
 }
 
-ssize_t ft_post_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
-		struct fi_rma_iov *remote, void *context)
+ssize_t ft_post_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context* ctx)
+{
+	return ft_post_tx_buf(ep, fi_addr, size, ctx, tx_buf);
+}
+
+ssize_t ft_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context *ctx)
+{
+	return ft_ctx_tx(ft_ctx_default(ep), fi_addr, size, ctx);
+}
+
+ssize_t ft_post_inject_buf(struct fid_ep *ep, size_t size, void *buf)
+{
+	return ft_ctx_post_inject_buf(ft_ctx_default(ep), size, buf);
+}
+
+ssize_t ft_post_inject(struct fid_ep *ep, size_t size)
+{
+	return ft_post_inject_buf(ep, size, tx_buf);
+}
+
+ssize_t ft_inject(struct fid_ep *ep, size_t size)
+{
+	return ft_ctx_inject(ft_ctx_default(ep), size);
+}
+
+ssize_t ft_post_rma_buf(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
+		struct fi_rma_iov *remote, void *context, void *buf)
 {
 	switch (op) {
 	case FT_RMA_WRITE:
-		FT_POST(fi_write, ft_get_tx_comp, tx_seq, "fi_write", ep, tx_buf,
-				opts.transfer_size, fi_mr_desc(mr), remote_fi_addr,
-				remote->addr, remote->key, context);
+		FT_POST(fi_write, ft_get_tx_comp(tx_seq), tx_seq, "fi_write",
+				ep, buf, opts.transfer_size, fi_mr_desc(mr),
+				remote_fi_addr, remote->addr, remote->key,
+				context);
 		break;
 	case FT_RMA_WRITEDATA:
-		FT_POST(fi_writedata, ft_get_tx_comp, tx_seq, "fi_writedata", ep,
-				tx_buf, opts.transfer_size, fi_mr_desc(mr),
-				remote_cq_data,	remote_fi_addr,	remote->addr,
-				remote->key, context);
+		FT_POST(fi_writedata, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_writedata", ep, buf, opts.transfer_size,
+				fi_mr_desc(mr), remote_cq_data, remote_fi_addr,
+				remote->addr, remote->key, context);
 		break;
 	case FT_RMA_READ:
-		FT_POST(fi_read, ft_get_tx_comp, tx_seq, "fi_read", ep, rx_buf,
-				opts.transfer_size, fi_mr_desc(mr), remote_fi_addr,
-				remote->addr, remote->key, context);
+		FT_POST(fi_read, ft_get_tx_comp(tx_seq), tx_seq, "fi_read",
+				ep, buf, opts.transfer_size, fi_mr_desc(mr),
+				remote_fi_addr, remote->addr, remote->key,
+				context);
 		break;
 	default:
 		FT_ERR("Unknown RMA op type\n");
@@ -1117,10 +1658,17 @@ ssize_t ft_post_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 	return 0;
 }
 
-ssize_t ft_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
+ssize_t ft_post_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 		struct fi_rma_iov *remote, void *context)
 {
-	int ret;
+	return ft_post_rma_buf(op, ep, size, remote, context,
+			       op == FT_RMA_READ ? rx_buf : tx_buf);
+}
+
+ssize_t ft_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
+		struct fi_rma_iov *remote, void *context)
+{
+	int ret;
 
 	ret = ft_post_rma(op, ep, size, remote, context);
 	if (ret)
@@ -1139,18 +1687,18 @@ ssize_t ft_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 	return 0;
 }
 
-ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
-		struct fi_rma_iov *remote)
+ssize_t ft_post_rma_inject_buf(enum ft_rma_opcodes op, struct fid_ep *ep,
+		size_t size, struct fi_rma_iov *remote, void *buf)
 {
 	switch (op) {
 	case FT_RMA_WRITE:
-		FT_POST(fi_inject_write, ft_get_tx_comp, tx_seq, "fi_inject_write",
-				ep, tx_buf, opts.transfer_size, remote_fi_addr,
-				remote->addr, remote->key);
+		FT_POST(fi_inject_write, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_inject_write", ep, buf, opts.transfer_size,
+				remote_fi_addr, remote->addr, remote->key);
 		break;
 	case FT_RMA_WRITEDATA:
-		FT_POST(fi_inject_writedata, ft_get_tx_comp, tx_seq,
-				"fi_inject_writedata", ep, tx_buf, opts.transfer_size,
+		FT_POST(fi_inject_writedata, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_inject_writedata", ep, buf, opts.transfer_size,
 				remote_cq_data, remote_fi_addr, remote->addr,
 				remote->key);
 		break;
@@ -1163,30 +1711,140 @@ ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t siz
 	return 0;
 }
 
-ssize_t ft_post_rx(struct fid_ep *ep, size_t size, struct fi_context* ctx)
+ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
+		struct fi_rma_iov *remote)
+{
+	return ft_post_rma_inject_buf(op, ep, size, remote, tx_buf);
+}
+
+/*
+ * Transmits posted with explicit flags.  With -Z the tx CQ is bound with
+ * FI_SELECTIVE_COMPLETION and only operations flagged FI_COMPLETION write
+ * an entry, so the others are counted as complete when posted, like
+ * injects.
+ */
+ssize_t ft_post_tx_flags(struct fid_ep *ep, fi_addr_t fi_addr, size_t size,
+		void *context, void *buf, uint64_t flags)
+{
+	struct iovec iov;
+	void *desc = fi_mr_desc(mr);
+
+	iov.iov_base = buf;
+	iov.iov_len = size + ft_tx_prefix_size();
+
+	if (hints->caps & FI_TAGGED) {
+		struct fi_msg_tagged tmsg;
+
+		memset(&tmsg, 0, sizeof tmsg);
+		tmsg.msg_iov = &iov;
+		tmsg.desc = &desc;
+		tmsg.iov_count = 1;
+		tmsg.addr = fi_addr;
+		tmsg.tag = tx_seq;
+		tmsg.context = context;
+
+		FT_POST(fi_tsendmsg, ft_get_tx_comp(tx_seq), tx_seq,
+				"transmit", ep, &tmsg, flags);
+	} else {
+		struct fi_msg msg;
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.desc = &desc;
+		msg.iov_count = 1;
+		msg.addr = fi_addr;
+		msg.context = context;
+
+		FT_POST(fi_sendmsg, ft_get_tx_comp(tx_seq), tx_seq,
+				"transmit", ep, &msg, flags);
+	}
+
+	if (!(flags & FI_COMPLETION))
+		tx_cq_cntr++;
+	return 0;
+}
+
+ssize_t ft_post_rma_flags(enum ft_rma_opcodes op, struct fid_ep *ep,
+		size_t size, struct fi_rma_iov *remote, void *context,
+		void *buf, uint64_t flags)
+{
+	struct fi_rma_iov rma_iov = *remote;
+	struct fi_msg_rma msg;
+	struct iovec iov;
+	void *desc = fi_mr_desc(mr);
+
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	rma_iov.len = size;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.desc = &desc;
+	msg.iov_count = 1;
+	msg.addr = remote_fi_addr;
+	msg.rma_iov = &rma_iov;
+	msg.rma_iov_count = 1;
+	msg.context = context;
+	msg.data = remote_cq_data;
+
+	switch (op) {
+	case FT_RMA_WRITE:
+		FT_POST(fi_writemsg, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_writemsg", ep, &msg, flags);
+		break;
+	case FT_RMA_WRITEDATA:
+		FT_POST(fi_writemsg, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_writemsg", ep, &msg,
+				flags | FI_REMOTE_CQ_DATA);
+		break;
+	case FT_RMA_READ:
+		FT_POST(fi_readmsg, ft_get_tx_comp(tx_seq), tx_seq,
+				"fi_readmsg", ep, &msg, flags);
+		break;
+	default:
+		FT_ERR("Unknown RMA op type\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!(flags & FI_COMPLETION))
+		tx_cq_cntr++;
+	return 0;
+}
+
+ssize_t ft_ctx_post_rx_buf(struct ft_ctx *c, size_t size,
+		struct fi_context *ctx, void *buf)
 {
+	ft_csum_fence(buf, MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size());
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_trecv, ft_get_rx_comp, rx_seq, "receive", ep, rx_buf,
+		FT_POST(fi_trecv, ft_ctx_rx_comp(c, c->rx_posted, 0), c->rx_posted,
+				"receive", c->ep, buf,
 				MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size(),
-				fi_mr_desc(mr), 0, rx_seq, 0, ctx);
+				fi_mr_desc(c->mr), 0, c->rx_posted, 0, ctx);
 	} else {
-		FT_POST(fi_recv, ft_get_rx_comp, rx_seq, "receive", ep, rx_buf,
+		FT_POST(fi_recv, ft_ctx_rx_comp(c, c->rx_posted, 0), c->rx_posted,
+				"receive", c->ep, buf,
 				MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size(),
-				fi_mr_desc(mr),	0, ctx);
+				fi_mr_desc(c->mr), 0, ctx);
 	}
 	return 0;
 }
 
-ssize_t ft_rx(struct fid_ep *ep, size_t size)
+ssize_t ft_ctx_post_rx(struct ft_ctx *c, size_t size, struct fi_context *ctx)
+{
+	return ft_ctx_post_rx_buf(c, size, ctx, c->rx_msg);
+}
+
+ssize_t ft_ctx_rx(struct ft_ctx *c, size_t size)
 {
 	ssize_t ret;
 
-	ret = ft_get_rx_comp(rx_seq);
+	ret = ft_ctx_get_rx_comp(c, c->rx_posted);
 	if (ret)
 		return ret;
 
 	if (ft_check_opts(FT_OPT_VERIFY_DATA | FT_OPT_ACTIVE)) {
-		ret = ft_check_buf((char *) rx_buf + ft_rx_prefix_size(), size);
+		ret = ft_check_buf((char *) c->rx_msg + ft_rx_prefix_size(),
+				   size);
 		if (ret)
 			return ret;
 	}
@@ -1196,35 +1854,76 @@ ssize_t ft_rx(struct fid_ep *ep, size_t size)
 	 * sizes. ft_sync() makes use of ft_rx() and gets called in tests just before
 	 * message size is updated. The recvs posted are always for the next incoming
 	 * message */
-	ret = ft_post_rx(ep, rx_size, &rx_ctx);
-	return ret;
+	return ft_ctx_post_rx(c, c->rx_msg_size, &c->rx_ctx);
+}
+
+ssize_t ft_post_rx_buf(struct fid_ep *ep, size_t size, struct fi_context* ctx,
+		void *buf)
+{
+	return ft_ctx_post_rx_buf(ft_ctx_default(ep), size, ctx, buf);
+}
+
+ssize_t ft_post_rx(struct fid_ep *ep, size_t size, struct fi_context* ctx)
+{
+	return ft_post_rx_buf(ep, size, ctx, rx_buf);
+}
+
+ssize_t ft_rx(struct fid_ep *ep, size_t size)
+{
+	return ft_ctx_rx(ft_ctx_default(ep), size);
 }
 
 /*
- * fi_cq_err_entry can be cast to any CQ entry format.
+ * fi_cq_err_entry can be cast to any CQ entry format.  Completions are reaped
+ * in batches of up to ft_comp_batch() entries, but never more than are still
+ * outstanding, so that entries for later operations are left on the CQ.
  */
+static inline size_t ft_comp_batch_cnt(uint64_t cur, uint64_t total)
+{
+	uint64_t left = total - cur;
+
+	return left < (uint64_t) ft_comp_batch() ? left : ft_comp_batch();
+}
+
+static inline ssize_t ft_cq_read(struct fid_cq *cq, void *comp, size_t cnt)
+{
+	ssize_t ret;
+
+	ret = fi_cq_read(cq, comp, cnt);
+	if (ret > 0 && ft_op_pool.cnt)
+		ft_op_reap(comp, ret);
+	return ret;
+}
+
 static int ft_spin_for_comp(struct fid_cq *cq, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
-	struct fi_cq_err_entry comp;
-	struct timespec a, b;
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	uint64_t a = 0, b;
+	int polls = 0, progress = 0;
 	int ret;
 
-	if (timeout >= 0)
-		clock_gettime(CLOCK_MONOTONIC, &a);
+	/* The clock is only read once every FT_TIMEOUT_POLLS empty polls, so
+	 * the timeout is measured from the last progress check. */
+	if (timeout >= 0) {
+		ft_timer_init();
+		a = ft_gettime_ns();
+	}
 
 	while (total - *cur > 0) {
-		ret = fi_cq_read(cq, &comp, 1);
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
 		if (ret > 0) {
-			if (timeout >= 0)
-				clock_gettime(CLOCK_MONOTONIC, &a);
-
-			(*cur)++;
+			progress = 1;
+			(*cur) += ret;
 		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
-		} else if (timeout >= 0) {
-			clock_gettime(CLOCK_MONOTONIC, &b);
-			if ((b.tv_sec - a.tv_sec) > timeout) {
+		} else if (timeout >= 0 && ++polls == FT_TIMEOUT_POLLS) {
+			polls = 0;
+			b = ft_gettime_ns();
+			if (progress) {
+				a = b;
+				progress = 0;
+			} else if ((b - a) / 1000000000ULL > (uint64_t) timeout) {
 				fprintf(stderr, "%ds timeout expired\n", timeout);
 				return -FI_ENODATA;
 			}
@@ -1235,36 +1934,61 @@ static int ft_spin_for_comp(struct fid_cq *cq, uint64_t *cur,
 }
 
 /*
- * fi_cq_err_entry can be cast to any CQ entry format.
+ * The blocking paths time out like the spin path: after timeout seconds
+ * without a completion.  start is 0 when there is no timeout.
  */
+static inline uint64_t ft_comp_start(int timeout)
+{
+	if (timeout < 0)
+		return 0;
+	ft_timer_init();
+	return ft_gettime_ns();
+}
+
+static int ft_comp_timedout(uint64_t start, int timeout)
+{
+	if (!start ||
+	    (ft_gettime_ns() - start) / 1000000000ULL <= (uint64_t) timeout)
+		return 0;
+
+	fprintf(stderr, "%ds timeout expired\n", timeout);
+	return 1;
+}
+
 static int ft_wait_for_comp(struct fid_cq *cq, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
-	struct fi_cq_err_entry comp;
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	uint64_t start = ft_comp_start(timeout);
 	int ret;
 
 	while (total - *cur > 0) {
-		ret = fi_cq_sread(cq, &comp, 1, NULL, timeout);
-		if (ret > 0)
-			(*cur)++;
-		else if (ret < 0 && ret != -FI_EAGAIN)
+		ret = fi_cq_sread(cq, comp, ft_comp_batch_cnt(*cur, total),
+				  NULL, timeout);
+		if (ret > 0 && ft_op_pool.cnt)
+			ft_op_reap(comp, ret);
+		if (ret > 0) {
+			(*cur) += ret;
+			if (start)
+				start = ft_gettime_ns();
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
+		} else if (ft_comp_timedout(start, timeout)) {
+			return -FI_ENODATA;
+		}
 	}
 
 	return 0;
 }
 
-/*
- * fi_cq_err_entry can be cast to any CQ entry format.
- */
-static int ft_fdwait_for_comp(struct fid_cq *cq, uint64_t *cur,
+static int ft_fdwait_for_comp(struct fid_cq *cq, int fd, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
-	struct fi_cq_err_entry comp;
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
 	struct fid *fids[1];
-	int fd, ret;
+	uint64_t start = ft_comp_start(timeout);
+	int ret;
 
-	fd = cq == txcq ? tx_fd : rx_fd;
 	fids[0] = &cq->fid;
 
 	while (total - *cur > 0) {
@@ -1275,29 +1999,211 @@ static int ft_fdwait_for_comp(struct fid_cq *cq, uint64_t *cur,
 				return ret;
 		}
 
-		ret = fi_cq_read(cq, &comp, 1);
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
 		if (ret > 0) {
-			(*cur)++;
+			(*cur) += ret;
+			if (start)
+				start = ft_gettime_ns();
 		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
+		} else if (ft_comp_timedout(start, timeout)) {
+			return -FI_ENODATA;
 		}
 	}
 
 	return 0;
 }
 
-static int ft_get_cq_comp(struct fid_cq *cq, uint64_t *cur,
-			  uint64_t total, int timeout)
+/*
+ * Spin until opts.spin_usec have passed without a completion, then wait on
+ * the fd.  The budget restarts after every completion read.
+ */
+static int ft_hybrid_for_comp(struct fid_cq *cq, int fd, uint64_t *cur,
+			      uint64_t total, int timeout)
 {
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	struct fid *fids[1];
+	uint64_t budget, deadline, start;
+	int woken = 0;
 	int ret;
 
-	switch (opts.comp_method) {
+	start = ft_comp_start(timeout);
+	ft_timer_init();
+	budget = (uint64_t) opts.spin_usec * 1000;
+	deadline = ft_gettime_ns() + budget;
+	fids[0] = &cq->fid;
+
+	while (total - *cur > 0) {
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
+		if (ret > 0) {
+			(*cur) += ret;
+			if (woken)
+				ft_comp_stats.wakeup += ret;
+			else
+				ft_comp_stats.spin += ret;
+			woken = 0;
+			deadline = ft_gettime_ns();
+			if (start)
+				start = deadline;
+			deadline += budget;
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
+			return ret;
+		} else if (ft_gettime_ns() >= deadline) {
+			if (ft_comp_timedout(start, timeout))
+				return -FI_ENODATA;
+			ret = fi_trywait(fabric, fids, 1);
+			if (ret == FI_SUCCESS) {
+				ret = ft_poll_fd(fd, timeout);
+				if (ret && ret != -FI_EAGAIN)
+					return ret;
+				woken = 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int ft_waitset_for_comp(struct fid_cq *cq, struct fid_wait *wait,
+			       uint64_t *cur, uint64_t total, int timeout)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	struct fid *fids[1];
+	uint64_t start = ft_comp_start(timeout);
+	int ret;
+
+	fids[0] = &wait->fid;
+
+	while (total - *cur > 0) {
+		ret = fi_trywait(fabric, fids, 1);
+		if (ret == FI_SUCCESS) {
+			ret = fi_wait(wait, timeout);
+			if (ret && ret != -FI_ETIMEDOUT && ret != -FI_EAGAIN)
+				return ret;
+		}
+
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
+		if (ret > 0) {
+			(*cur) += ret;
+			if (start)
+				start = ft_gettime_ns();
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
+			return ret;
+		} else if (ft_comp_timedout(start, timeout)) {
+			return -FI_ENODATA;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * fi_poll() does not block; it progresses the pollset and returns the
+ * contexts of its CQs that have completions.  The CQ is only read once
+ * it has been reported.
+ */
+static int ft_pollset_for_comp(struct fid_cq *cq, struct fid_poll *pset,
+			       uint64_t *cur, uint64_t total, int timeout)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	uint64_t start = ft_comp_start(timeout);
+	void *ready[2];
+	int i, ret;
+
+	while (total - *cur > 0) {
+		ret = fi_poll(pset, ready, 2);
+		if (ret < 0 && ret != -FI_EAGAIN)
+			return ret;
+
+		for (i = 0; i < ret && ready[i] != cq->fid.context; i++)
+			;
+		if (ret <= 0 || i == ret) {
+			if (ft_comp_timedout(start, timeout))
+				return -FI_ENODATA;
+			continue;
+		}
+
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
+		if (ret > 0) {
+			(*cur) += ret;
+			if (start)
+				start = ft_gettime_ns();
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
+			return ret;
+		} else if (ft_comp_timedout(start, timeout)) {
+			return -FI_ENODATA;
+		}
+	}
+
+	return 0;
+}
+
+#if HAVE_EPOLL
+static int ft_epoll_for_comp(struct fid_cq *cq, int efd, uint64_t *cur,
+			     uint64_t total, int timeout)
+{
+	struct fi_cq_err_entry comp[FT_COMP_BATCH_MAX];
+	struct epoll_event events[2];
+	struct fid *fids[1];
+	uint64_t start = ft_comp_start(timeout);
+	int ret;
+
+	fids[0] = &cq->fid;
+
+	while (total - *cur > 0) {
+		ret = fi_trywait(fabric, fids, 1);
+		if (ret == FI_SUCCESS) {
+			ret = epoll_wait(efd, events, 2, timeout);
+			if (ret < 0 && errno != EINTR) {
+				ret = -errno;
+				FT_PRINTERR("epoll_wait", ret);
+				return ret;
+			}
+		}
+
+		ret = ft_cq_read(cq, comp, ft_comp_batch_cnt(*cur, total));
+		if (ret > 0) {
+			(*cur) += ret;
+			if (start)
+				start = ft_gettime_ns();
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
+			return ret;
+		} else if (ft_comp_timedout(start, timeout)) {
+			return -FI_ENODATA;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int ft_get_cq_comp(struct ft_ctx *c, struct fid_cq *cq, int fd,
+			  uint64_t *cur, uint64_t total, int timeout)
+{
+	int ret;
+
+	switch (c->comp_method) {
 	case FT_COMP_SREAD:
 		ret = ft_wait_for_comp(cq, cur, total, timeout);
 		break;
+	case FT_COMP_WAITSET:
+		ret = ft_waitset_for_comp(cq, c->wait_set, cur, total, timeout);
+		break;
 	case FT_COMP_WAIT_FD:
-		ret = ft_fdwait_for_comp(cq, cur, total, timeout);
+		ret = ft_fdwait_for_comp(cq, fd, cur, total, timeout);
+		break;
+	case FT_COMP_HYBRID:
+		ret = ft_hybrid_for_comp(cq, fd, cur, total, timeout);
+		break;
+	case FT_COMP_POLLSET:
+		ret = ft_pollset_for_comp(cq, c->poll_set, cur, total,
+					  timeout);
 		break;
+#if HAVE_EPOLL
+	case FT_COMP_EPOLL:
+		ret = ft_epoll_for_comp(cq, c->epoll_fd, cur, total, timeout);
+		break;
+#endif
 	default:
 		ret = ft_spin_for_comp(cq, cur, total, timeout);
 		break;
@@ -1314,15 +2220,16 @@ static int ft_get_cq_comp(struct fid_cq *cq, uint64_t *cur,
 	return ret;
 }
 
-int ft_get_rx_comp(uint64_t total)
+static int ft_ctx_rx_comp(struct ft_ctx *c, uint64_t total, int timeout)
 {
 	int ret = FI_SUCCESS;
 
-	if (rxcq) {
-		ret = ft_get_cq_comp(rxcq, &rx_cq_cntr, total, timeout);
-	} else if (rxcntr) {
-		while (fi_cntr_read(rxcntr) < total) {
-			ret = fi_cntr_wait(rxcntr, total, timeout);
+	if (c->rx_cq) {
+		ret = ft_get_cq_comp(c, c->rx_cq, c->rx_wait_fd, &c->rx_completed,
+				     total, timeout);
+	} else if (c->rx_cntr) {
+		while (fi_cntr_read(c->rx_cntr) < total) {
+			ret = fi_cntr_wait(c->rx_cntr, total, timeout);
 			if (ret)
 				FT_PRINTERR("fi_cntr_wait", ret);
 			else
@@ -1335,14 +2242,20 @@ int ft_get_rx_comp(uint64_t total)
 	return ret;
 }
 
-int ft_get_tx_comp(uint64_t total)
+int ft_ctx_get_rx_comp(struct ft_ctx *c, uint64_t total)
+{
+	return ft_ctx_rx_comp(c, total, timeout);
+}
+
+int ft_ctx_get_tx_comp(struct ft_ctx *c, uint64_t total)
 {
 	int ret;
 
-	if (txcq) {
-		ret = ft_get_cq_comp(txcq, &tx_cq_cntr, total, -1);
-	} else if (txcntr) {
-		ret = fi_cntr_wait(txcntr, total, -1);
+	if (c->tx_cq) {
+		ret = ft_get_cq_comp(c, c->tx_cq, c->tx_wait_fd, &c->tx_completed,
+				     total, -1);
+	} else if (c->tx_cntr) {
+		ret = fi_cntr_wait(c->tx_cntr, total, -1);
 		if (ret)
 			FT_PRINTERR("fi_cntr_wait", ret);
 	} else {
@@ -1352,6 +2265,16 @@ int ft_get_tx_comp(uint64_t total)
 	return ret;
 }
 
+int ft_get_rx_comp(uint64_t total)
+{
+	return ft_ctx_get_rx_comp(ft_ctx_default(ep), total);
+}
+
+int ft_get_tx_comp(uint64_t total)
+{
+	return ft_ctx_get_tx_comp(ft_ctx_default(ep), total);
+}
+
 int ft_cq_readerr(struct fid_cq *cq)
 {
 	struct fi_cq_err_entry cq_err;
@@ -1367,6 +2290,61 @@ int ft_cq_readerr(struct fid_cq *cq)
 	return ret;
 }
 
+static size_t ft_cq_entry_size(enum fi_cq_format format)
+{
+	switch (format) {
+	case FI_CQ_FORMAT_MSG:
+		return sizeof(struct fi_cq_msg_entry);
+	case FI_CQ_FORMAT_DATA:
+		return sizeof(struct fi_cq_data_entry);
+	case FI_CQ_FORMAT_TAGGED:
+		return sizeof(struct fi_cq_tagged_entry);
+	default:
+		return sizeof(struct fi_cq_entry);
+	}
+}
+
+/* Called once the CQs are open, so that cq_attr holds their format */
+int ft_op_pool_alloc(int cnt)
+{
+	int i;
+
+	ft_op_pool.op = calloc(cnt, sizeof(*ft_op_pool.op));
+	if (!ft_op_pool.op)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < cnt; i++)
+		ft_op_pool.op[i].done = 1;
+	ft_op_pool.cnt = cnt;
+	ft_op_pool.entry_size = ft_cq_entry_size(cq_attr.format);
+	return 0;
+}
+
+/* Every CQ entry format starts with op_context */
+void ft_op_reap(const void *comp, int cnt)
+{
+	const char *entry = comp;
+	struct ft_op_ctx *op;
+	uint64_t now = 0;
+	int i, res;
+
+	res = (opts.options & (FT_OPT_ACTIVE | FT_OPT_RESIDENCY)) ==
+	      (FT_OPT_ACTIVE | FT_OPT_RESIDENCY);
+	if (res)
+		now = ft_timer_ticks();
+
+	for (i = 0; i < cnt; i++, entry += ft_op_pool.entry_size) {
+		op = ((const struct fi_cq_entry *) entry)->op_context;
+		if (op < ft_op_pool.op || op >= ft_op_pool.op + ft_op_pool.cnt)
+			continue;
+		op->done = 1;
+		ft_op_pool.reaped++;
+		if (res)
+			ft_hist_add(&res_hist,
+				    ft_timer_ticks_to_ns(now - op->post_tick));
+	}
+}
+
 void eq_readerr(struct fid_eq *eq, const char *eq_str)
 {
 	struct fi_eq_err_entry eq_err;
@@ -1401,21 +2379,30 @@ int ft_sync()
 	return ret;
 }
 
+/* The parent syncs with all of its children, reporting the first failure */
 int ft_sync_pair(int status)
 {
-	int ret;
-	int pair_status;
+	int ret, i;
+	int pair_status, child_status;
 
 	if (ft_parent_proc) {
-		ret = write(ft_socket_pair[1], &status, sizeof(int));
-		if (ret < 0) {
-			FT_PRINTERR("write", errno);
-			return ret;
+		for (i = 0; i < ft_child_cnt; i++) {
+			ret = write(ft_child_pairs[i][1], &status, sizeof(int));
+			if (ret < 0) {
+				FT_PRINTERR("write", errno);
+				return ret;
+			}
 		}
-		ret = read(ft_socket_pair[1], &pair_status, sizeof(int));
-		if (ret < 0) {
-			FT_PRINTERR("read", errno);
-			return ret;
+		pair_status = FI_SUCCESS;
+		for (i = 0; i < ft_child_cnt; i++) {
+			ret = read(ft_child_pairs[i][1], &child_status,
+				   sizeof(int));
+			if (ret < 0) {
+				FT_PRINTERR("read", errno);
+				return ret;
+			}
+			if (pair_status == FI_SUCCESS)
+				pair_status = child_status;
 		}
 	} else {
 		ret = read(ft_socket_pair[0], &pair_status, sizeof(int));
@@ -1437,50 +2424,109 @@ int ft_sync_pair(int status)
 	return 0;
 }
 
-int ft_fork_and_pair()
+static int ft_close_pair(int pair[2])
 {
 	int ret;
 
-	ret = socketpair(AF_LOCAL, SOCK_STREAM, 0, ft_socket_pair);
+	ret = close(pair[0]);
 	if (ret) {
-		FT_PRINTERR("socketpair", errno);
-		return -errno;
+		FT_PRINTERR("close", errno);
+		return ret;
 	}
+	ret = close(pair[1]);
+	if (ret) {
+		FT_PRINTERR("close", errno);
+		return ret;
+	}
+	return 0;
+}
 
-	ft_child_pid = fork();
-	if (ft_child_pid < 0) {
-		FT_PRINTERR("fork", ft_child_pid);
-		return -errno;
+/*
+ * Fork cnt children, each connected to the parent by its own socket pair.
+ * ft_child_id is the child's index, or -1 in the parent.  In a child,
+ * ft_socket_pair is its pair to the parent; in the parent, it is the pair
+ * to child 0.
+ */
+int ft_fork_children(int cnt)
+{
+	pid_t pid;
+	int i, ret;
+
+	ft_child_pids = calloc(cnt, sizeof(*ft_child_pids));
+	ft_child_pairs = calloc(cnt, sizeof(*ft_child_pairs));
+	if (!ft_child_pids || !ft_child_pairs)
+		return -FI_ENOMEM;
+
+	ft_parent_proc = 1;
+	for (i = 0; i < cnt; i++) {
+		ret = socketpair(AF_LOCAL, SOCK_STREAM, 0, ft_child_pairs[i]);
+		if (ret) {
+			FT_PRINTERR("socketpair", errno);
+			return -errno;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			ret = -errno;
+			FT_PRINTERR("fork", ret);
+			return ret;
+		}
+		if (!pid) {
+			/* a child only talks to the parent */
+			while (ft_child_cnt)
+				ft_close_pair(ft_child_pairs[--ft_child_cnt]);
+			ft_socket_pair[0] = ft_child_pairs[i][0];
+			ft_socket_pair[1] = ft_child_pairs[i][1];
+			free(ft_child_pids);
+			free(ft_child_pairs);
+			ft_child_pids = NULL;
+			ft_child_pairs = NULL;
+			ft_child_id = i;
+			ft_parent_proc = 0;
+			return 0;
+		}
+		ft_child_pids[ft_child_cnt++] = pid;
 	}
-	if (ft_child_pid)
-		ft_parent_proc = 1;
 
+	ft_socket_pair[0] = ft_child_pairs[0][0];
+	ft_socket_pair[1] = ft_child_pairs[0][1];
+	ft_child_pid = ft_child_pids[0];
 	return 0;
 }
 
+int ft_fork_and_pair()
+{
+	return ft_fork_children(1);
+}
+
+/* In the parent, returns -FI_EOTHER if any child exited with an error */
 int ft_wait_child()
 {
-	int ret;
+	int ret, i, status, child_ret = 0;
 
-	ret = close(ft_socket_pair[0]);
-	if (ret) {
-		FT_PRINTERR("close", errno);
-		return ret;
-	}
-	ret = close(ft_socket_pair[1]);
-	if (ret) {
-		FT_PRINTERR("close", errno);
-		return ret;
-	}
-	if (ft_parent_proc) {
-		ret = waitpid(ft_child_pid, NULL, WCONTINUED);
+	if (!ft_parent_proc)
+		return ft_close_pair(ft_socket_pair);
+
+	for (i = 0; i < ft_child_cnt; i++) {
+		ret = ft_close_pair(ft_child_pairs[i]);
+		if (ret)
+			return ret;
+
+		ret = waitpid(ft_child_pids[i], &status, WCONTINUED);
 		if (ret < 0) {
 			FT_PRINTERR("waitpid", errno);
 			return ret;
 		}
+		if (WIFEXITED(status) && WEXITSTATUS(status))
+			child_ret = -FI_EOTHER;
 	}
 
-	return 0;
+	free(ft_child_pids);
+	free(ft_child_pairs);
+	ft_child_pids = NULL;
+	ft_child_pairs = NULL;
+	ft_child_cnt = 0;
+	return child_ret;
 }
 
 int ft_finalize(void)
@@ -1506,7 +2552,8 @@ int ft_finalize(void)
 		tmsg.ignore = 0;
 		tmsg.context = &ctx;
 
-		ret = fi_tsendmsg(ep, &tmsg, FI_INJECT | FI_TRANSMIT_COMPLETE);
+		ret = fi_tsendmsg(ep, &tmsg, FI_INJECT | FI_TRANSMIT_COMPLETE |
+				  FI_COMPLETION);
 	} else {
 		struct fi_msg msg;
 
@@ -1517,7 +2564,8 @@ int ft_finalize(void)
 		msg.addr = remote_fi_addr;
 		msg.context = &ctx;
 
-		ret = fi_sendmsg(ep, &msg, FI_INJECT | FI_TRANSMIT_COMPLETE);
+		ret = fi_sendmsg(ep, &msg, FI_INJECT | FI_TRANSMIT_COMPLETE |
+				  FI_COMPLETION);
 	}
 	if (ret) {
 		FT_PRINTERR("transmit", ret);
@@ -1525,100 +2573,828 @@ int ft_finalize(void)
 	}
 
 
-	ret = ft_get_tx_comp(++tx_seq);
-	if (ret)
-		return ret;
+	ret = ft_get_tx_comp(++tx_seq);
+	if (ret)
+		return ret;
+
+	ret = ft_get_rx_comp(rx_seq);
+	if (ret)
+		return ret;
+
+	return ft_csum_drain();
+}
+
+#if FT_HAVE_TSC
+/* CPUID.80000007H:EDX[8] reports a constant rate TSC that runs in all
+ * ACPI P-, C- and T-states. */
+static int ft_tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+	    eax < 0x80000007)
+		return 0;
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return !!(edx & (1 << 8));
+}
+
+static int ft_tsc_calibrate(void)
+{
+	uint64_t tick_start, tick_end, nsec_start, nsec_end;
+
+	nsec_start = ft_clock_ns();
+	tick_start = ft_rdtsc();
+	do {
+		nsec_end = ft_clock_ns();
+	} while (nsec_end - nsec_start < FT_TSC_CALIBRATE_NSEC);
+	tick_end = ft_rdtsc();
+
+	if (tick_end <= tick_start)
+		return -FI_EOTHER;
+
+	ft_timer.nsec_per_tick = (double) (nsec_end - nsec_start) /
+				 (tick_end - tick_start);
+	ft_timer.base_tick = tick_end;
+	ft_timer.base_nsec = nsec_end;
+	ft_timer.src = FT_TIMER_TSC;
+	return 0;
+}
+#endif
+
+void ft_timer_init(void)
+{
+	if (ft_timer.init)
+		return;
+
+#if FT_HAVE_TSC
+	if (ft_tsc_invariant() && !ft_tsc_calibrate()) {
+		ft_timer.init = 1;
+		return;
+	}
+#endif
+	ft_timer.src = FT_TIMER_CLOCK;
+	ft_timer.nsec_per_tick = 1.0;
+	ft_timer.base_tick = 0;
+	ft_timer.base_nsec = 0;
+	ft_timer.init = 1;
+}
+
+void ft_timer_gettime(struct timespec *ts)
+{
+	uint64_t nsec = ft_gettime_ns();
+
+	ts->tv_sec = nsec / 1000000000ULL;
+	ts->tv_nsec = nsec % 1000000000ULL;
+}
+
+int64_t get_elapsed(const struct timespec *b, const struct timespec *a,
+		    enum precision p)
+{
+	int64_t elapsed;
+
+	elapsed = difftime(a->tv_sec, b->tv_sec) * 1000 * 1000 * 1000;
+	elapsed += a->tv_nsec - b->tv_nsec;
+	return elapsed / p;
+}
+
+static uint64_t ft_tv_usec(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+#if HAVE_PERF_EVENT
+static int ft_perf_fd[FT_PERF_EV_CNT] = { -1, -1, -1, -1 };
+static int ft_perf_leader = -1;
+static int ft_perf_opened;
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} ft_perf_events[FT_PERF_EV_CNT] = {
+	[FT_PERF_EV_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[FT_PERF_EV_INSTR] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[FT_PERF_EV_CACHE_MISS] = { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_CACHE_MISSES },
+	[FT_PERF_EV_ITLB_MISS] = { PERF_TYPE_HW_CACHE,
+				   PERF_COUNT_HW_CACHE_ITLB |
+				   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static int ft_perf_event_open(int ev, int group_fd, int exclude_kernel)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = ft_perf_events[ev].type;
+	attr.config = ft_perf_events[ev].config;
+	attr.disabled = group_fd < 0;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/*
+ * The counters form one group on the calling thread, led by the first one
+ * that opens, so they are scheduled together.  Kernel time is left out if
+ * the system does not allow counting it, and counters the CPU lacks stay
+ * closed.
+ */
+static void ft_perf_open(void)
+{
+	int i, exclude_kernel = 0;
+
+	ft_perf_opened = 1;
+	for (i = 0; i < FT_PERF_EV_CNT; i++) {
+		ft_perf_fd[i] = ft_perf_event_open(i, ft_perf_leader,
+						   exclude_kernel);
+		if (ft_perf_fd[i] < 0 && ft_perf_leader < 0 && !exclude_kernel &&
+		    (errno == EACCES || errno == EPERM)) {
+			exclude_kernel = 1;
+			ft_perf_fd[i] = ft_perf_event_open(i, ft_perf_leader,
+							   exclude_kernel);
+		}
+		if (ft_perf_fd[i] >= 0 && ft_perf_leader < 0)
+			ft_perf_leader = ft_perf_fd[i];
+	}
+
+	if (ft_perf_leader < 0)
+		FT_WARN("perf_event_open: %s, hardware counters disabled",
+			strerror(errno));
+}
+#endif
+
+void ft_rusage_start(void)
+{
+	ft_rusage.valid = 0;
+#if HAVE_PERF_EVENT
+	if (opts.options & FT_OPT_PERF_EVENTS) {
+		if (!ft_perf_opened)
+			ft_perf_open();
+		if (ft_perf_leader >= 0) {
+			ioctl(ft_perf_leader, PERF_EVENT_IOC_RESET,
+			      PERF_IOC_FLAG_GROUP);
+			ioctl(ft_perf_leader, PERF_EVENT_IOC_ENABLE,
+			      PERF_IOC_FLAG_GROUP);
+		}
+	}
+#endif
+	getrusage(RUSAGE_SELF, &ft_rusage_ru);
+}
+
+void ft_rusage_stop(void)
+{
+	struct rusage ru;
+	int i;
+
+	getrusage(RUSAGE_SELF, &ru);
+	ft_rusage.utime_usec = ft_tv_usec(&ru.ru_utime) -
+			      ft_tv_usec(&ft_rusage_ru.ru_utime);
+	ft_rusage.stime_usec = ft_tv_usec(&ru.ru_stime) -
+			      ft_tv_usec(&ft_rusage_ru.ru_stime);
+	ft_rusage.nvcsw = ru.ru_nvcsw - ft_rusage_ru.ru_nvcsw;
+	ft_rusage.nivcsw = ru.ru_nivcsw - ft_rusage_ru.ru_nivcsw;
+	ft_rusage.wall_usec = get_elapsed(&start, &end, MICRO);
+
+	for (i = 0; i < FT_PERF_EV_CNT; i++)
+		ft_rusage.events[i] = -1;
+#if HAVE_PERF_EVENT
+	if (ft_perf_leader >= 0) {
+		uint64_t val;
+
+		ioctl(ft_perf_leader, PERF_EVENT_IOC_DISABLE,
+		      PERF_IOC_FLAG_GROUP);
+		for (i = 0; i < FT_PERF_EV_CNT; i++) {
+			if (ft_perf_fd[i] >= 0 &&
+			    read(ft_perf_fd[i], &val, sizeof val) == sizeof val)
+				ft_rusage.events[i] = val;
+		}
+	}
+#endif
+	ft_rusage.valid = 1;
+}
+
+void ft_hist_reset(struct ft_hist *hist)
+{
+	memset(hist, 0, sizeof *hist);
+	hist->min = UINT64_MAX;
+}
+
+static uint64_t ft_hist_bucket_val(int index)
+{
+	int shift;
+	uint64_t low;
+
+	if (index < FT_HIST_SUB_CNT)
+		return index;
+
+	shift = (index >> FT_HIST_SUB_BITS) - 1;
+	low = (uint64_t) (FT_HIST_SUB_CNT + (index & (FT_HIST_SUB_CNT - 1)))
+		<< shift;
+	return low + ((1ULL << shift) >> 1);
+}
+
+/*
+ * Returns the sample value at the given percentile (0-100).  The value is
+ * reported as the midpoint of the matching bucket, clamped to the recorded
+ * min/max so that p0 and p100 are exact.
+ */
+uint64_t ft_hist_percentile(const struct ft_hist *hist, double pct)
+{
+	uint64_t target, cnt = 0;
+	uint64_t val;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	target = (uint64_t) (pct / 100.0 * hist->count + 0.5);
+	if (target < 1)
+		target = 1;
+	else if (target > hist->count)
+		target = hist->count;
+
+	for (i = 0; i < FT_HIST_BUCKETS; i++) {
+		cnt += hist->bucket[i];
+		if (cnt >= target)
+			break;
+	}
+
+	val = ft_hist_bucket_val(i);
+	return MIN(MAX(val, hist->min), hist->max);
+}
+
+/* Mean absolute difference between consecutive samples */
+double ft_hist_jitter(const struct ft_hist *hist)
+{
+	return hist->count > 1 ? hist->delta_sum / (hist->count - 1) : 0.0;
+}
+
+/* The jitter of the merged histogram ignores the step between the two */
+void ft_hist_merge(struct ft_hist *dst, const struct ft_hist *src)
+{
+	int i;
+
+	if (!src->count)
+		return;
+
+	for (i = 0; i < FT_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->delta_sum += src->delta_sum;
+	dst->last = src->last;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+static int ft_show_lat_hist(void)
+{
+	return (opts.options & FT_OPT_LAT_HIST) && lat_hist.count;
+}
+
+/*
+ * Latency percentiles are reported per transfer, the same way as usec/xfer,
+ * so a ping-pong round trip is divided by xfers_per_iter.
+ */
+static double ft_hist_usec(uint64_t nsec, int xfers_per_iter)
+{
+	return nsec / 1000.0 / xfers_per_iter;
+}
+
+static void ft_hist_fill(double usec[FT_PERF_LAT_CNT],
+			 const struct ft_hist *hist, int xfers_per_iter)
+{
+	usec[FT_PERF_LAT_MIN] = ft_hist_usec(hist->min, xfers_per_iter);
+	usec[FT_PERF_LAT_P50] = ft_hist_usec(
+		ft_hist_percentile(hist, 50), xfers_per_iter);
+	usec[FT_PERF_LAT_P90] = ft_hist_usec(
+		ft_hist_percentile(hist, 90), xfers_per_iter);
+	usec[FT_PERF_LAT_P99] = ft_hist_usec(
+		ft_hist_percentile(hist, 99), xfers_per_iter);
+	usec[FT_PERF_LAT_P999] = ft_hist_usec(
+		ft_hist_percentile(hist, 99.9), xfers_per_iter);
+	usec[FT_PERF_LAT_MAX] = ft_hist_usec(hist->max, xfers_per_iter);
+	usec[FT_PERF_LAT_JITTER] =
+		ft_hist_jitter(hist) / 1000.0 / xfers_per_iter;
+}
+
+static const char *ft_lat_names[FT_PERF_LAT_CNT] = {
+	[FT_PERF_LAT_MIN] = "min",
+	[FT_PERF_LAT_P50] = "p50",
+	[FT_PERF_LAT_P90] = "p90",
+	[FT_PERF_LAT_P99] = "p99",
+	[FT_PERF_LAT_P999] = "p99.9",
+	[FT_PERF_LAT_MAX] = "max",
+	[FT_PERF_LAT_JITTER] = "jitter",
+};
+
+static const char *ft_verify_str(void);
+
+static const char *ft_perf_ev_names[FT_PERF_EV_CNT] = {
+	[FT_PERF_EV_CYCLES] = "cycles",
+	[FT_PERF_EV_INSTR] = "instructions",
+	[FT_PERF_EV_CACHE_MISS] = "cache_misses",
+	[FT_PERF_EV_ITLB_MISS] = "itlb_misses",
+};
+
+static const char *ft_ep_type_str(void)
+{
+	if (!fi || !fi->ep_attr)
+		return "unspec";
+
+	switch (fi->ep_attr->type) {
+	case FI_EP_MSG:
+		return "msg";
+	case FI_EP_RDM:
+		return "rdm";
+	case FI_EP_DGRAM:
+		return "dgram";
+	default:
+		return "unspec";
+	}
+}
+
+static const char *ft_comp_method_str(void)
+{
+	if (opts.options & (FT_OPT_RX_CNTR | FT_OPT_TX_CNTR) &&
+	    !(opts.options & (FT_OPT_RX_CQ | FT_OPT_TX_CQ)))
+		return "counter";
+
+	switch (opts.comp_method) {
+	case FT_COMP_SREAD:
+		return "sread";
+	case FT_COMP_WAITSET:
+		return "waitset";
+	case FT_COMP_WAIT_FD:
+		return "fd";
+	case FT_COMP_HYBRID:
+		return "hybrid";
+	case FT_COMP_POLLSET:
+		return "pollset";
+	case FT_COMP_EPOLL:
+		return "epoll";
+	default:
+		return "spin";
+	}
+}
+
+static double ft_per_xfer(const struct ft_perf_rec *rec, int64_t cnt)
+{
+	long long xfers = (long long) rec->iterations * rec->xfers_per_iter;
+
+	return cnt >= 0 && xfers ? (double) cnt / xfers : -1;
+}
+
+/* Usage of the last ft_start()/ft_stop() interval, if it has ended */
+static void ft_perf_init_usage(struct ft_perf_rec *rec)
+{
+	int i;
+
+	for (i = 0; i < FT_PERF_EV_CNT; i++)
+		rec->events[i] = -1;
+	rec->cycles_per_xfer = rec->instr_per_xfer = -1;
+	if (!ft_rusage.valid)
+		return;
+
+	rec->usage_valid = 1;
+	rec->utime_usec = ft_rusage.utime_usec;
+	rec->stime_usec = ft_rusage.stime_usec;
+	rec->nvcsw = ft_rusage.nvcsw;
+	rec->nivcsw = ft_rusage.nivcsw;
+	if (ft_rusage.wall_usec > 0)
+		rec->cpu_pct = 100.0 * (rec->utime_usec + rec->stime_usec) /
+			       ft_rusage.wall_usec;
+	for (i = 0; i < FT_PERF_EV_CNT; i++)
+		rec->events[i] = ft_rusage.events[i];
+	rec->cycles_per_xfer = ft_per_xfer(rec, rec->events[FT_PERF_EV_CYCLES]);
+	rec->instr_per_xfer = ft_per_xfer(rec, rec->events[FT_PERF_EV_INSTR]);
+}
+
+/* Cost of -v pattern generation and checking within the timed interval */
+static void ft_perf_init_verify(struct ft_perf_rec *rec)
+{
+	double nsec;
+
+	if (!ft_verify_stats.bytes)
+		return;
+
+	nsec = ft_timer_ticks_to_ns(ft_verify_stats.ticks);
+	rec->verify_ms_per_gb = nsec / 1e6 / (ft_verify_stats.bytes / 1e9);
+	if (rec->elapsed_usec > 0)
+		rec->verify_pct = nsec / 10.0 / rec->elapsed_usec;
+}
+
+void ft_perf_init_rec(struct ft_perf_rec *rec, char *name, int tsize,
+		int iters, struct timespec *start, struct timespec *end,
+		int xfers_per_iter)
+{
+	memset(rec, 0, sizeof *rec);
+	rec->name = name;
+	rec->prov_name = fi && fi->fabric_attr && fi->fabric_attr->prov_name ?
+			 fi->fabric_attr->prov_name : "";
+	rec->ep_type = ft_ep_type_str();
+	rec->comp_method = ft_comp_method_str();
+	rec->window_size = opts.options & FT_OPT_BW ? opts.window_size : 1;
+	rec->xfer_size = tsize;
+	rec->iterations = iters;
+	rec->xfers_per_iter = xfers_per_iter;
+	rec->bytes = (long long) iters * tsize * xfers_per_iter;
+	rec->elapsed_usec = get_elapsed(start, end, MICRO);
+	rec->mbps = rec->bytes / (1.0 * rec->elapsed_usec);
+	rec->usec_per_xfer = (double) rec->elapsed_usec / iters / xfers_per_iter;
+	rec->mxfers_per_sec = 1.0 / rec->usec_per_xfer;
+	rec->argc = opts.argc;
+	rec->argv = opts.argv;
+	rec->mem_type = ft_mem_type_str(buf_mem_type);
+	rec->mem_node = buf_mem_node;
+	ft_get_cpu(&rec->cpu, &rec->cpu_node);
+	rec->comp_spin = ft_comp_stats.spin;
+	rec->comp_wakeup = ft_comp_stats.wakeup;
+	ft_perf_init_usage(rec);
+	ft_perf_init_verify(rec);
+
+	if (ft_show_lat_hist()) {
+		rec->lat_valid = 1;
+		ft_hist_fill(rec->lat_usec, &lat_hist, xfers_per_iter);
+	}
 
-	ret = ft_get_rx_comp(rx_seq);
-	if (ret)
-		return ret;
+	/* Residency is per operation, however many make up an iteration */
+	if ((opts.options & FT_OPT_RESIDENCY) && res_hist.count) {
+		rec->res_valid = 1;
+		ft_hist_fill(rec->res_usec, &res_hist, 1);
+	}
+}
 
-	return 0;
+/* Buffer placement is only shown in text and YAML output when requested */
+static int ft_show_mem(void)
+{
+	return opts.mem_type != FT_MEM_DEFAULT || (opts.options & FT_OPT_NUMA);
 }
 
-int64_t get_elapsed(const struct timespec *b, const struct timespec *a,
-		    enum precision p)
+/* Share of completions that were read before blocking, in percent */
+static double ft_comp_spin_pct(const struct ft_perf_rec *rec)
 {
-	int64_t elapsed;
+	uint64_t total = rec->comp_spin + rec->comp_wakeup;
 
-	elapsed = difftime(a->tv_sec, b->tv_sec) * 1000 * 1000 * 1000;
-	elapsed += a->tv_nsec - b->tv_nsec;
-	return elapsed / p;
+	return total ? 100.0 * rec->comp_spin / total : 0;
 }
 
-void show_perf(char *name, int tsize, int iters, struct timespec *start,
-		struct timespec *end, int xfers_per_iter)
+static void ft_perf_text_count(double val)
+{
+	if (val >= 0)
+		printf("%11.1f", val);
+	else
+		printf("%11s", "-");
+}
+
+static void ft_perf_text(const struct ft_perf_rec *rec)
 {
 	static int header = 1;
 	char str[FT_STR_LEN];
-	int64_t elapsed = get_elapsed(start, end, MICRO);
-	long long bytes = (long long) iters * tsize * xfers_per_iter;
-	float usec_per_xfer;
-
-	if (name) {
-		if (header) {
-			printf("%-50s%-8s%-8s%-8s%8s %10s%13s%13s\n",
-					"name", "bytes", "iters",
-					"total", "time", "MB/sec",
-					"usec/xfer", "Mxfers/sec");
-			header = 0;
-		}
+	int i;
 
-		printf("%-50s", name);
-	} else {
-		if (header) {
-			printf("%-8s%-8s%-8s%8s %10s%13s%13s\n",
-					"bytes", "iters", "total",
-					"time", "MB/sec", "usec/xfer",
-					"Mxfers/sec");
-			header = 0;
+	if (header) {
+		if (ft_show_mem())
+			printf("# buffers: %s pages, numa node %d\n",
+				rec->mem_type, rec->mem_node);
+		if (opts.options & FT_OPT_CPU)
+			printf("# cpu: %d, numa node %d\n", rec->cpu,
+				rec->cpu_node);
+		if (opts.options & FT_OPT_VERIFY_DATA)
+			printf("# verify: %s\n", ft_verify_str());
+		if (rec->name)
+			printf("%-50s", "name");
+		printf("%-8s%-8s%-8s%8s %10s%13s%13s",
+				"bytes", "iters", "total",
+				"time", "MB/sec", "usec/xfer",
+				"Mxfers/sec");
+		if (rec->lat_valid) {
+			for (i = 0; i < FT_PERF_LAT_CNT; i++)
+				printf("%11s", ft_lat_names[i]);
+		}
+		if (opts.options & FT_OPT_RESIDENCY) {
+			for (i = 0; i < FT_PERF_LAT_CNT; i++) {
+				snprintf(str, sizeof str, "res %s",
+					 ft_lat_names[i]);
+				printf("%11s", str);
+			}
 		}
+		if (opts.comp_method == FT_COMP_HYBRID)
+			printf("%8s", "%spin");
+		printf("%8s", "%cpu");
+		if (opts.options & FT_OPT_PERF_EVENTS)
+			printf("%11s%11s", "cyc/xfer", "ins/xfer");
+		if (opts.options & FT_OPT_VERIFY_DATA)
+			printf("%11s%8s", "vfy ms/GB", "%vfy");
+		printf("\n");
+		header = 0;
 	}
 
-	printf("%-8s", size_str(str, tsize));
+	if (rec->name)
+		printf("%-50s", rec->name);
 
-	printf("%-8s", cnt_str(str, iters));
+	printf("%-8s", size_str(str, rec->xfer_size));
 
-	printf("%-8s", size_str(str, bytes));
+	printf("%-8s", cnt_str(str, rec->iterations));
 
-	usec_per_xfer = ((float)elapsed / iters / xfers_per_iter);
-	printf("%8.2fs%10.2f%11.2f%11.2f\n",
-		elapsed / 1000000.0, bytes / (1.0 * elapsed),
-		usec_per_xfer, 1.0/usec_per_xfer);
+	printf("%-8s", size_str(str, rec->bytes));
+
+	printf("%8.2fs%10.2f%11.2f%11.2f",
+		rec->elapsed_usec / 1000000.0, rec->mbps,
+		rec->usec_per_xfer, rec->mxfers_per_sec);
+	if (rec->lat_valid) {
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf("%11.2f", rec->lat_usec[i]);
+	}
+	if (opts.options & FT_OPT_RESIDENCY) {
+		for (i = 0; i < FT_PERF_LAT_CNT; i++) {
+			if (rec->res_valid)
+				printf("%11.2f", rec->res_usec[i]);
+			else
+				printf("%11s", "-");
+		}
+	}
+	if (opts.comp_method == FT_COMP_HYBRID)
+		printf("%8.1f", ft_comp_spin_pct(rec));
+	if (rec->usage_valid)
+		printf("%8.1f", rec->cpu_pct);
+	else
+		printf("%8s", "-");
+	if (opts.options & FT_OPT_PERF_EVENTS) {
+		ft_perf_text_count(rec->cycles_per_xfer);
+		ft_perf_text_count(rec->instr_per_xfer);
+	}
+	if (opts.options & FT_OPT_VERIFY_DATA)
+		printf("%11.2f%8.1f", rec->verify_ms_per_gb, rec->verify_pct);
+	printf("\n");
 }
 
-void show_perf_mr(int tsize, int iters, struct timespec *start,
-		  struct timespec *end, int xfers_per_iter, int argc, char *argv[])
+static void ft_perf_yaml(const struct ft_perf_rec *rec)
 {
 	static int header = 1;
-	int64_t elapsed = get_elapsed(start, end, MICRO);
-	long long total = (long long) iters * tsize * xfers_per_iter;
 	int i;
-	float usec_per_xfer;
 
 	if (header) {
 		printf("---\n");
 
-		for (i = 0; i < argc; ++i)
-			printf("%s ", argv[i]);
+		for (i = 0; i < rec->argc; ++i)
+			printf("%s ", rec->argv[i]);
 
 		printf(":\n");
 		header = 0;
 	}
 
-	usec_per_xfer = ((float)elapsed / iters / xfers_per_iter);
-
 	printf("- { ");
-	printf("xfer_size: %d, ", tsize);
-	printf("iterations: %d, ", iters);
-	printf("total: %lld, ", total);
-	printf("time: %f, ", elapsed / 1000000.0);
-	printf("MB/sec: %f, ", (total) / (1.0 * elapsed));
-	printf("usec/xfer: %f, ", usec_per_xfer);
-	printf("Mxfers/sec: %f", 1.0/usec_per_xfer);
+	printf("xfer_size: %d, ", rec->xfer_size);
+	printf("iterations: %d, ", rec->iterations);
+	printf("total: %lld, ", rec->bytes);
+	printf("time: %f, ", rec->elapsed_usec / 1000000.0);
+	printf("MB/sec: %f, ", rec->mbps);
+	printf("usec/xfer: %f, ", rec->usec_per_xfer);
+	printf("Mxfers/sec: %f", rec->mxfers_per_sec);
+	if (rec->lat_valid) {
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf(", usec_%s: %f", ft_lat_names[i], rec->lat_usec[i]);
+	}
+	if (rec->res_valid) {
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf(", res_usec_%s: %f", ft_lat_names[i],
+				rec->res_usec[i]);
+	}
+	if (ft_show_mem())
+		printf(", mem_type: %s, mem_node: %d", rec->mem_type,
+			rec->mem_node);
+	if (opts.options & FT_OPT_CPU)
+		printf(", cpu: %d, cpu_node: %d", rec->cpu, rec->cpu_node);
+	if (opts.comp_method == FT_COMP_HYBRID)
+		printf(", comp_spin: %" PRIu64 ", comp_wakeup: %" PRIu64
+			", spin_pct: %f", rec->comp_spin, rec->comp_wakeup,
+			ft_comp_spin_pct(rec));
+	if (rec->usage_valid) {
+		printf(", cpu_pct: %f, utime_usec: %" PRIu64
+			", stime_usec: %" PRIu64 ", vol_csw: %ld"
+			", invol_csw: %ld", rec->cpu_pct, rec->utime_usec,
+			rec->stime_usec, rec->nvcsw, rec->nivcsw);
+		if (opts.options & FT_OPT_PERF_EVENTS) {
+			for (i = 0; i < FT_PERF_EV_CNT; i++)
+				printf(", %s: %" PRId64, ft_perf_ev_names[i],
+					rec->events[i]);
+			printf(", cycles_per_xfer: %f, instr_per_xfer: %f",
+				rec->cycles_per_xfer, rec->instr_per_xfer);
+		}
+	}
+	if (opts.options & FT_OPT_VERIFY_DATA)
+		printf(", verify_ms_per_gb: %f, verify_pct: %f",
+			rec->verify_ms_per_gb, rec->verify_pct);
 	printf(" }\n");
 }
 
+static void ft_perf_json_chars(const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+}
+
+static void ft_perf_csv_chars(const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '"')
+			putchar('"');
+		putchar(*str);
+	}
+}
+
+/* Quoted string built from the given characters, or the command line. */
+static void ft_perf_str(void (*chars)(const char *), const char *str,
+			const struct ft_perf_rec *rec)
+{
+	int i;
+
+	putchar('"');
+	if (str) {
+		chars(str);
+	} else {
+		for (i = 0; i < rec->argc; i++) {
+			if (i)
+				putchar(' ');
+			chars(rec->argv[i]);
+		}
+	}
+	putchar('"');
+}
+
+/* One self-contained JSON object per line (JSON Lines). */
+static void ft_perf_json(const struct ft_perf_rec *rec)
+{
+	int i;
+
+	printf("{");
+	if (rec->name) {
+		printf("\"name\": ");
+		ft_perf_str(ft_perf_json_chars, rec->name, rec);
+		printf(", ");
+	}
+	printf("\"provider\": ");
+	ft_perf_str(ft_perf_json_chars, rec->prov_name, rec);
+	printf(", \"ep_type\": \"%s\"", rec->ep_type);
+	printf(", \"comp_method\": \"%s\"", rec->comp_method);
+	printf(", \"window_size\": %d", rec->window_size);
+	printf(", \"xfer_size\": %d", rec->xfer_size);
+	printf(", \"iterations\": %d", rec->iterations);
+	printf(", \"xfers_per_iter\": %d", rec->xfers_per_iter);
+	printf(", \"bytes\": %lld", rec->bytes);
+	printf(", \"elapsed_usec\": %" PRId64, rec->elapsed_usec);
+	printf(", \"mbps\": %f", rec->mbps);
+	printf(", \"usec_per_xfer\": %f", rec->usec_per_xfer);
+	printf(", \"mxfers_per_sec\": %f", rec->mxfers_per_sec);
+	if (rec->lat_valid) {
+		printf(", \"lat_usec\": {");
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf("%s\"%s\": %f", i ? ", " : "", ft_lat_names[i],
+				rec->lat_usec[i]);
+		printf("}");
+	}
+	if (rec->res_valid) {
+		printf(", \"res_usec\": {");
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf("%s\"%s\": %f", i ? ", " : "", ft_lat_names[i],
+				rec->res_usec[i]);
+		printf("}");
+	}
+	printf(", \"mem_type\": \"%s\"", rec->mem_type);
+	printf(", \"mem_node\": %d", rec->mem_node);
+	printf(", \"cpu\": %d", rec->cpu);
+	printf(", \"cpu_node\": %d", rec->cpu_node);
+	printf(", \"comp_spin\": %" PRIu64, rec->comp_spin);
+	printf(", \"comp_wakeup\": %" PRIu64, rec->comp_wakeup);
+	if (rec->usage_valid) {
+		printf(", \"cpu_pct\": %f", rec->cpu_pct);
+		printf(", \"utime_usec\": %" PRIu64, rec->utime_usec);
+		printf(", \"stime_usec\": %" PRIu64, rec->stime_usec);
+		printf(", \"vol_csw\": %ld", rec->nvcsw);
+		printf(", \"invol_csw\": %ld", rec->nivcsw);
+		printf(", \"perf\": {");
+		for (i = 0; i < FT_PERF_EV_CNT; i++)
+			printf("%s\"%s\": %" PRId64, i ? ", " : "",
+				ft_perf_ev_names[i], rec->events[i]);
+		printf(", \"cycles_per_xfer\": %f", rec->cycles_per_xfer);
+		printf(", \"instr_per_xfer\": %f}", rec->instr_per_xfer);
+	}
+	printf(", \"verify_ms_per_gb\": %f", rec->verify_ms_per_gb);
+	printf(", \"verify_pct\": %f", rec->verify_pct);
+	printf(", \"cmdline\": ");
+	ft_perf_str(ft_perf_json_chars, NULL, rec);
+	printf("}\n");
+}
+
+static void ft_perf_csv(const struct ft_perf_rec *rec)
+{
+	static int header = 1;
+	int i;
+
+	if (header) {
+		printf("name,provider,ep_type,comp_method,window_size,"
+			"xfer_size,iterations,xfers_per_iter,bytes,"
+			"elapsed_usec,mbps,usec_per_xfer,mxfers_per_sec");
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf(",usec_%s", ft_lat_names[i]);
+		for (i = 0; i < FT_PERF_LAT_CNT; i++)
+			printf(",res_usec_%s", ft_lat_names[i]);
+		printf(",mem_type,mem_node,cpu,cpu_node,comp_spin,"
+			"comp_wakeup,cpu_pct,utime_usec,stime_usec,vol_csw,"
+			"invol_csw");
+		for (i = 0; i < FT_PERF_EV_CNT; i++)
+			printf(",%s", ft_perf_ev_names[i]);
+		printf(",cycles_per_xfer,instr_per_xfer,verify_ms_per_gb,"
+			"verify_pct,cmdline\n");
+		header = 0;
+	}
+
+	ft_perf_str(ft_perf_csv_chars, rec->name ? rec->name : "", rec);
+	putchar(',');
+	ft_perf_str(ft_perf_csv_chars, rec->prov_name, rec);
+	printf(",%s,%s,%d,%d,%d,%d,%lld,%" PRId64 ",%f,%f,%f",
+		rec->ep_type, rec->comp_method, rec->window_size,
+		rec->xfer_size, rec->iterations, rec->xfers_per_iter,
+		rec->bytes, rec->elapsed_usec, rec->mbps,
+		rec->usec_per_xfer, rec->mxfers_per_sec);
+	for (i = 0; i < FT_PERF_LAT_CNT; i++) {
+		if (rec->lat_valid)
+			printf(",%f", rec->lat_usec[i]);
+		else
+			putchar(',');
+	}
+	for (i = 0; i < FT_PERF_LAT_CNT; i++) {
+		if (rec->res_valid)
+			printf(",%f", rec->res_usec[i]);
+		else
+			putchar(',');
+	}
+	printf(",%s,%d,%d,%d,%" PRIu64 ",%" PRIu64, rec->mem_type,
+		rec->mem_node, rec->cpu, rec->cpu_node, rec->comp_spin,
+		rec->comp_wakeup);
+	if (rec->usage_valid) {
+		printf(",%f,%" PRIu64 ",%" PRIu64 ",%ld,%ld", rec->cpu_pct,
+			rec->utime_usec, rec->stime_usec, rec->nvcsw,
+			rec->nivcsw);
+		for (i = 0; i < FT_PERF_EV_CNT; i++)
+			printf(",%" PRId64, rec->events[i]);
+		printf(",%f,%f", rec->cycles_per_xfer, rec->instr_per_xfer);
+	} else {
+		printf(",,,,,");
+		for (i = 0; i < FT_PERF_EV_CNT; i++)
+			putchar(',');
+		printf(",,");
+	}
+	printf(",%f,%f,", rec->verify_ms_per_gb, rec->verify_pct);
+	ft_perf_str(ft_perf_csv_chars, NULL, rec);
+	putchar('\n');
+}
+
+static void (*ft_perf_sinks[FT_PERF_FMT_CNT])(const struct ft_perf_rec *) = {
+	[FT_PERF_TEXT] = ft_perf_text,
+	[FT_PERF_YAML] = ft_perf_yaml,
+	[FT_PERF_JSON] = ft_perf_json,
+	[FT_PERF_CSV] = ft_perf_csv,
+};
+
+void ft_perf_write(enum ft_perf_fmt fmt, const struct ft_perf_rec *rec)
+{
+	if (fmt >= FT_PERF_FMT_CNT)
+		fmt = FT_PERF_TEXT;
+	ft_perf_sinks[fmt](rec);
+}
+
+void show_perf(char *name, int tsize, int iters, struct timespec *start,
+		struct timespec *end, int xfers_per_iter)
+{
+	struct ft_perf_rec rec;
+
+	ft_perf_init_rec(&rec, name, tsize, iters, start, end, xfers_per_iter);
+	ft_perf_write(opts.perf_fmt, &rec);
+}
+
+void show_perf_mr(int tsize, int iters, struct timespec *start,
+		  struct timespec *end, int xfers_per_iter, int argc, char *argv[])
+{
+	struct ft_perf_rec rec;
+
+	ft_perf_init_rec(&rec, NULL, tsize, iters, start, end, xfers_per_iter);
+	rec.argc = argc;
+	rec.argv = argv;
+	ft_perf_write(opts.perf_fmt == FT_PERF_TEXT ? FT_PERF_YAML :
+		      opts.perf_fmt, &rec);
+}
+
 void ft_basic_usage(char *desc)
 {
 	if (desc)
@@ -1665,8 +3441,14 @@ void ft_csusage(char *name, char *desc)
 	FT_PRINT_OPTS_USAGE("-S <size>", "specific transfer size or 'all'");
 	FT_PRINT_OPTS_USAGE("-l", "align transmit and receive buffers to page size");
 	FT_PRINT_OPTS_USAGE("-m", "machine readable output");
+	FT_PRINT_OPTS_USAGE("-M <type>", "buffer memory [default, hugetlb, thp]");
+	FT_PRINT_OPTS_USAGE("-N <node>", "bind buffers to NUMA node");
+	FT_PRINT_OPTS_USAGE("-C <cpu-list>", "pin threads to cpus, e.g. 0,2,4-7");
+	FT_PRINT_OPTS_USAGE("-O <format>", "result format [text, yaml, json, csv]");
+	FT_PRINT_OPTS_USAGE("-E", "report cycles and instructions per transfer");
 	FT_PRINT_OPTS_USAGE("-t <type>", "completion type [queue, counter]");
-	FT_PRINT_OPTS_USAGE("-c <method>", "completion method [spin, sread, fd]");
+	FT_PRINT_OPTS_USAGE("-c <method>", "completion method [spin, sread, fd, "
+			"hybrid[:usec], waitset, pollset, epoll]");
 	FT_PRINT_OPTS_USAGE("-h", "display this help output");
 
 	return;
@@ -1759,10 +3541,21 @@ void ft_parsecsopts(int op, char *optarg, struct ft_opts *opts)
 		opts->machr = 1;
 		break;
 	case 'c':
-		if (!strncasecmp("sread", optarg, 5))
+		if (!strncasecmp("sread", optarg, 5)) {
 			opts->comp_method = FT_COMP_SREAD;
-		else if (!strncasecmp("fd", optarg, 2))
+		} else if (!strncasecmp("fd", optarg, 2)) {
 			opts->comp_method = FT_COMP_WAIT_FD;
+		} else if (!strncasecmp("hybrid", optarg, 6)) {
+			opts->comp_method = FT_COMP_HYBRID;
+			if (optarg[6] == ':')
+				opts->spin_usec = atoi(optarg + 7);
+		} else if (!strncasecmp("waitset", optarg, 7)) {
+			opts->comp_method = FT_COMP_WAITSET;
+		} else if (!strncasecmp("pollset", optarg, 7)) {
+			opts->comp_method = FT_COMP_POLLSET;
+		} else if (!strncasecmp("epoll", optarg, 5)) {
+			opts->comp_method = FT_COMP_EPOLL;
+		}
 		break;
 	case 't':
 		if (!strncasecmp("counter", optarg, 7)) {
@@ -1779,6 +3572,43 @@ void ft_parsecsopts(int op, char *optarg, struct ft_opts *opts)
 	case 'l':
 		opts->options |= FT_OPT_ALIGN;
 		break;
+	case 'M':
+		if (!strncasecmp("hugetlb", optarg, 7))
+			opts->mem_type = FT_MEM_HUGETLB;
+		else if (!strncasecmp("thp", optarg, 3))
+			opts->mem_type = FT_MEM_THP;
+		else
+			opts->mem_type = FT_MEM_DEFAULT;
+		break;
+	case 'N':
+		opts->options |= FT_OPT_NUMA;
+		opts->numa_node = atoi(optarg);
+		break;
+	case 'C':
+		opts->options |= FT_OPT_CPU;
+		if (ft_parse_cpu_list(optarg) <= 0) {
+			FT_ERR("Invalid cpu list: %s\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		if (ft_pin_thread(0) < 0)
+			exit(EXIT_FAILURE);
+		break;
+	case 'E':
+		opts->options |= FT_OPT_PERF_EVENTS;
+#if !HAVE_PERF_EVENT
+		FT_WARN("hardware counters are not supported on this system");
+#endif
+		break;
+	case 'O':
+		if (!strncasecmp("yaml", optarg, 4))
+			opts->perf_fmt = FT_PERF_YAML;
+		else if (!strncasecmp("json", optarg, 4))
+			opts->perf_fmt = FT_PERF_JSON;
+		else if (!strncasecmp("csv", optarg, 3))
+			opts->perf_fmt = FT_PERF_CSV;
+		else
+			opts->perf_fmt = FT_PERF_TEXT;
+		break;
 	default:
 		/* let getopt handle unknown opts*/
 		break;
@@ -1810,41 +3640,476 @@ int ft_parse_rma_opts(int op, char *optarg, struct ft_opts *opts)
 	return 0;
 }
 
+/*
+ * The -v pattern repeats the alphabet from an offset picked per message.
+ * integ_block holds the alphabet repeated to cover any offset plus one
+ * chunk, and a chunk is a whole number of periods, so every chunk of a
+ * message is copied from or compared to the same span of integ_block.
+ */
+#define FT_INTEG_LEN	(sizeof(integ_alphabet) - 1)
+#define FT_INTEG_CHUNK	(FT_INTEG_LEN * 64)
+
+static char integ_block[FT_INTEG_LEN + FT_INTEG_CHUNK];
+
+static void ft_integ_copy_scalar(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+/* Returns the index of the first differing byte, or len */
+static size_t ft_integ_cmp_scalar(const char *buf, const char *pat, size_t len)
+{
+	size_t i;
+
+	if (!memcmp(buf, pat, len))
+		return len;
+	for (i = 0; buf[i] == pat[i]; i++)
+		;
+	return i;
+}
+
+#if FT_HAVE_SIMD
+__attribute__((target("sse2")))
+static void ft_integ_copy_sse2(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_loadu_si128((const __m128i *) (src + i)));
+	memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t ft_integ_cmp_sse2(const char *buf, const char *pat, size_t len)
+{
+	__m128i a, b;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		a = _mm_loadu_si128((const __m128i *) (buf + i));
+		b = _mm_loadu_si128((const __m128i *) (pat + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+			break;
+	}
+	for (; i < len && buf[i] == pat[i]; i++)
+		;
+	return i;
+}
+
+__attribute__((target("avx2")))
+static void ft_integ_copy_avx2(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *) (dst + i),
+				    _mm256_loadu_si256((const __m256i *) (src + i)));
+	memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ft_integ_cmp_avx2(const char *buf, const char *pat, size_t len)
+{
+	__m256i a, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *) (buf + i));
+		b = _mm256_loadu_si256((const __m256i *) (pat + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != -1)
+			break;
+	}
+	for (; i < len && buf[i] == pat[i]; i++)
+		;
+	return i;
+}
+#endif
+
+static const char *integ_kernel = "scalar";
+static void (*integ_copy)(char *dst, const char *src, size_t len) =
+	ft_integ_copy_scalar;
+static size_t (*integ_cmp)(const char *buf, const char *pat, size_t len) =
+	ft_integ_cmp_scalar;
+
+static void ft_integ_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof integ_block; i++)
+		integ_block[i] = integ_alphabet[i % FT_INTEG_LEN];
+
+#if FT_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		integ_kernel = "avx2";
+		integ_copy = ft_integ_copy_avx2;
+		integ_cmp = ft_integ_cmp_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		integ_kernel = "sse2";
+		integ_copy = ft_integ_copy_sse2;
+		integ_cmp = ft_integ_cmp_sse2;
+	}
+#endif
+}
+
+/*
+ * -V stamps the first FT_CSUM_HDR bytes of each message with a sequence
+ * number and the CRC32C of the rest of the message, extended by the
+ * sequence number and size.  The payload is left as it is, so the sender
+ * only extends a CRC of the payload cached per buffer; the cache is valid
+ * from ft_start() on, while nothing but headers is written.  Messages
+ * shorter than the header are not checked.
+ */
+struct ft_csum_hdr {
+	uint32_t seq;
+	uint32_t crc;
+};
+
+#define FT_CSUM_HDR	((int) sizeof(struct ft_csum_hdr))
+#define FT_CSUM_CACHE	256
+#define FT_CSUM_RING	1024
+
+static uint32_t csum_table[256];
+
+static uint32_t ft_crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--)
+		crc = csum_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if FT_HAVE_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t ft_crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t w;
+#ifdef __x86_64__
+	uint64_t c = crc, v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof v);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t) c;
+#endif
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&w, p, sizeof w);
+		crc = _mm_crc32_u32(crc, w);
+	}
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+static const char *csum_kernel;
+static uint32_t (*csum_crc)(uint32_t crc, const void *data, size_t len);
+
+static void ft_csum_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		for (crc = i, j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		csum_table[i] = crc;
+	}
+	csum_kernel = "table";
+	csum_crc = ft_crc32c_sw;
+
+#if FT_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		csum_kernel = "sse4.2";
+		csum_crc = ft_crc32c_sse42;
+	}
+#endif
+}
+
+static uint32_t ft_csum_payload(const char *buf, int size)
+{
+	return csum_crc(~0U, buf + FT_CSUM_HDR, size - FT_CSUM_HDR);
+}
+
+static uint32_t ft_csum_msg(uint32_t payload, uint32_t seq, int size)
+{
+	uint32_t tail[2] = { seq, (uint32_t) size };
+
+	return ~csum_crc(payload, tail, sizeof tail);
+}
+
+static struct {
+	const char *buf;
+	int size;
+	unsigned int gen;
+	uint32_t crc;
+} csum_cache[FT_CSUM_CACHE];
+
+static uint32_t csum_tx_seq, csum_rx_seq;
+
+static void ft_csum_stamp(char *buf, int size)
+{
+	struct ft_csum_hdr hdr;
+	unsigned int k;
+	uint32_t crc;
+
+	if (!(opts.options & FT_OPT_ACTIVE)) {
+		crc = ft_csum_payload(buf, size);
+	} else {
+		k = ((uintptr_t) buf >> 6) % FT_CSUM_CACHE;
+		if (csum_cache[k].buf != buf || csum_cache[k].size != size ||
+		    csum_cache[k].gen != ft_csum_gen) {
+			csum_cache[k].buf = buf;
+			csum_cache[k].size = size;
+			csum_cache[k].gen = ft_csum_gen;
+			csum_cache[k].crc = ft_csum_payload(buf, size);
+		}
+		crc = csum_cache[k].crc;
+	}
+
+	hdr.seq = csum_tx_seq++;
+	hdr.crc = ft_csum_msg(crc, hdr.seq, size);
+	memcpy(buf, &hdr, sizeof hdr);
+}
+
+static int ft_csum_verify(const char *buf, int size, uint32_t seq)
+{
+	struct ft_csum_hdr hdr;
+	uint32_t crc;
+
+	memcpy(&hdr, buf, sizeof hdr);
+	crc = ft_csum_msg(ft_csum_payload(buf, size), hdr.seq, size);
+	if (crc != hdr.crc) {
+		FT_ERR("checksum mismatch at message=%u size=%d: "
+		       "0x%08x, expected 0x%08x", seq, size, crc, hdr.crc);
+		return 1;
+	}
+	if (hdr.seq != seq) {
+		FT_ERR("message=%u size=%d arrived out of sequence as %u",
+		       seq, size, hdr.seq);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * -V thread: the receiving thread hands completed buffers to a verifier
+ * thread over a single producer, single consumer ring.  A buffer is not
+ * reposted before the verifier is done with it, see ft_csum_fence().
+ */
+struct ft_csum_slot {
+	const char *buf;
+	int size;
+	uint32_t seq;
+};
+
+static struct {
+	struct ft_csum_slot slot[FT_CSUM_RING];
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	int stop;
+	int err;
+	int running;
+	pthread_t thread;
+} csum_ring;
+
+static void *ft_csum_thread(void *arg)
+{
+	struct ft_csum_slot *slot;
+	uint64_t head, tail = 0;
+	int stop;
+
+	for (;;) {
+		stop = __atomic_load_n(&csum_ring.stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&csum_ring.head, __ATOMIC_ACQUIRE);
+		if (tail == head) {
+			if (stop)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		slot = &csum_ring.slot[tail % FT_CSUM_RING];
+		if (ft_csum_verify(slot->buf, slot->size, slot->seq))
+			__atomic_store_n(&csum_ring.err, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&csum_ring.tail, ++tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static int ft_csum_post(const char *buf, int size, uint32_t seq)
+{
+	struct ft_csum_slot *slot;
+	int ret;
+
+	if (!csum_ring.running) {
+		ret = pthread_create(&csum_ring.thread, NULL, ft_csum_thread,
+				     NULL);
+		if (ret) {
+			FT_PRINTERR("pthread_create", -ret);
+			return 1;
+		}
+		csum_ring.running = 1;
+	}
+
+	while (csum_ring.head - __atomic_load_n(&csum_ring.tail,
+				__ATOMIC_ACQUIRE) == FT_CSUM_RING)
+		sched_yield();
+
+	slot = &csum_ring.slot[csum_ring.head % FT_CSUM_RING];
+	slot->buf = buf;
+	slot->size = size;
+	slot->seq = seq;
+	__atomic_store_n(&csum_ring.head, csum_ring.head + 1, __ATOMIC_RELEASE);
+
+	return __atomic_load_n(&csum_ring.err, __ATOMIC_ACQUIRE);
+}
+
+/* Wait for the verifier to finish with any message within buf */
+static void ft_csum_fence(const void *buf, size_t len)
+{
+	const char *start = buf, *end = start + len;
+	uint64_t i, wait = 0;
+
+	if (!csum_ring.running ||
+	    csum_ring.head == __atomic_load_n(&csum_ring.tail, __ATOMIC_ACQUIRE))
+		return;
+
+	for (i = csum_ring.tail; i < csum_ring.head; i++) {
+		if (csum_ring.slot[i % FT_CSUM_RING].buf >= start &&
+		    csum_ring.slot[i % FT_CSUM_RING].buf < end)
+			wait = i + 1;
+	}
+	while (__atomic_load_n(&csum_ring.tail, __ATOMIC_ACQUIRE) < wait)
+		sched_yield();
+}
+
+/* Wait for all queued messages to be verified, returns -FI_EIO on errors */
+static int ft_csum_drain(void)
+{
+	if (!csum_ring.running)
+		return 0;
+
+	while (__atomic_load_n(&csum_ring.tail, __ATOMIC_ACQUIRE) !=
+	       csum_ring.head)
+		sched_yield();
+
+	return __atomic_load_n(&csum_ring.err, __ATOMIC_ACQUIRE) ? -FI_EIO : 0;
+}
+
+static void ft_csum_stop(void)
+{
+	if (!csum_ring.running)
+		return;
+
+	__atomic_store_n(&csum_ring.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(csum_ring.thread, NULL);
+	csum_ring.running = 0;
+	csum_ring.stop = 0;
+}
+
+static int ft_csum_check(char *buf, int size)
+{
+	uint32_t seq = csum_rx_seq++;
+
+	if (opts.verify_mode == FT_VERIFY_CSUM_THREAD)
+		return ft_csum_post(buf, size, seq);
+
+	return ft_csum_verify(buf, size, seq);
+}
+
+static const char *ft_verify_str(void)
+{
+	static char str[FT_STR_LEN];
+
+	if (opts.verify_mode == FT_VERIFY_PATTERN) {
+		if (!integ_block[0])
+			ft_integ_init();
+		return integ_kernel;
+	}
+
+	if (!csum_crc)
+		ft_csum_init();
+	snprintf(str, sizeof str, "crc32c %s, %s", csum_kernel,
+		 opts.verify_mode == FT_VERIFY_CSUM ? "inline" : "thread");
+	return str;
+}
+
 void ft_fill_buf(void *buf, int size)
 {
 	char *msg_buf;
 	int msg_index;
 	static unsigned int iter = 0;
-	int i;
+	uint64_t stamp;
+	int i, n;
+
+	if (opts.verify_mode != FT_VERIFY_PATTERN) {
+		if (!csum_crc)
+			ft_csum_init();
+		stamp = ft_timer_ticks();
+		if (size >= FT_CSUM_HDR)
+			ft_csum_stamp(buf, size);
+		ft_verify_stats.ticks += ft_timer_ticks() - stamp;
+		ft_verify_stats.bytes += size;
+		return;
+	}
+
+	if (!integ_block[0])
+		ft_integ_init();
 
+	stamp = ft_timer_ticks();
 	msg_index = ((iter++)*INTEG_SEED) % integ_alphabet_length;
 	msg_buf = (char *)buf;
-	for (i = 0; i < size; i++) {
-		msg_buf[i] = integ_alphabet[msg_index++];
-		if (msg_index >= integ_alphabet_length)
-			msg_index = 0;
+	for (i = 0; i < size; i += n) {
+		n = MIN(size - i, FT_INTEG_CHUNK);
+		integ_copy(msg_buf + i, integ_block + msg_index, n);
 	}
+	ft_verify_stats.ticks += ft_timer_ticks() - stamp;
+	ft_verify_stats.bytes += size;
 }
 
 int ft_check_buf(void *buf, int size)
 {
 	char *recv_data;
-	char c;
 	static unsigned int iter = 0;
+	uint64_t stamp;
 	int msg_index;
-	int i;
+	int i, n, k;
+
+	if (opts.verify_mode != FT_VERIFY_PATTERN) {
+		if (!csum_crc)
+			ft_csum_init();
+		stamp = ft_timer_ticks();
+		k = size >= FT_CSUM_HDR ? ft_csum_check(buf, size) : 0;
+		ft_verify_stats.ticks += ft_timer_ticks() - stamp;
+		ft_verify_stats.bytes += size;
+		return k;
+	}
 
+	if (!integ_block[0])
+		ft_integ_init();
+
+	stamp = ft_timer_ticks();
 	msg_index = ((iter++)*INTEG_SEED) % integ_alphabet_length;
 	recv_data = (char *)buf;
 
-	for (i = 0; i < size; i++) {
-		c = integ_alphabet[msg_index++];
-		if (msg_index >= integ_alphabet_length)
-			msg_index = 0;
-		if (c != recv_data[i])
+	for (i = 0; i < size; i += n) {
+		n = MIN(size - i, FT_INTEG_CHUNK);
+		k = integ_cmp(recv_data + i, integ_block + msg_index, n);
+		if (k != n) {
+			i += k;
 			break;
+		}
 	}
-	if (i != size) {
+	ft_verify_stats.ticks += ft_timer_ticks() - stamp;
+	ft_verify_stats.bytes += size;
+
+	if (i < size) {
 		printf("Error at iteration=%d size=%d byte=%d\n",
 			iter, size, i);
 		return 1;
@@ -1855,12 +4120,8 @@ int ft_check_buf(void *buf, int size)
 
 uint64_t get_time_usec(void)
 {
-	struct timeval tv;
-	uint64_t usecs;
-
-	gettimeofday(&tv, NULL);
-	usecs = (tv.tv_sec * 1000000) + tv.tv_usec;
-	return usecs;
+	ft_timer_init();
+	return ft_gettime_ns() / 1000;
 }
 
 uint64_t ft_init_cq_data(struct fi_info *info)
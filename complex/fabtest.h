@@ -109,7 +109,6 @@ enum {
 	FT_MAX_PROV_MODES	= 4,
 	FT_MAX_WAIT_OBJ		= 5,
 	FT_DEFAULT_CREDITS	= 128,
-	FT_COMP_BUF_SIZE	= 256,
 };
 
 enum ft_comp_type {
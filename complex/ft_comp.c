@@ -32,14 +32,6 @@
 #include "fabtest.h"
 
 
-static size_t comp_entry_cnt[] = {
-	[FI_CQ_FORMAT_UNSPEC] = 0,
-	[FI_CQ_FORMAT_CONTEXT] = FT_COMP_BUF_SIZE / sizeof(struct fi_cq_entry),
-	[FI_CQ_FORMAT_MSG] = FT_COMP_BUF_SIZE / sizeof(struct fi_cq_msg_entry),
-	[FI_CQ_FORMAT_DATA] = FT_COMP_BUF_SIZE / sizeof(struct fi_cq_data_entry),
-	[FI_CQ_FORMAT_TAGGED] = FT_COMP_BUF_SIZE / sizeof(struct fi_cq_tagged_entry)
-};
-
 /*
 static size_t comp_entry_size[] = {
 	[FI_CQ_FORMAT_UNSPEC] = 0,
@@ -139,8 +131,8 @@ int ft_bind_comp(struct fid_ep *ep, uint64_t flags)
 static int ft_comp_x(struct fid_cq *cq, struct ft_xcontrol *ft_x,
 		const char *x_str, int timeout)
 {
-	uint8_t buf[FT_COMP_BUF_SIZE];
-	struct timespec s, e;
+	struct fi_cq_err_entry buf[FT_COMP_BATCH_MAX];
+	uint64_t s = 0;
 	int poll_time = 0;
 	int ret;
 
@@ -148,20 +140,20 @@ static int ft_comp_x(struct fid_cq *cq, struct ft_xcontrol *ft_x,
 	case FI_WAIT_NONE:
 		do {
 			if (!poll_time)
-				clock_gettime(CLOCK_MONOTONIC, &s);
+				s = ft_timer_ticks();
 
-			ft_cq_read(fi_cq_read, cq, buf, comp_entry_cnt[ft_x->cq_format],
+			ft_cq_read(fi_cq_read, cq, buf, ft_comp_batch(),
 					ft_x->credits, x_str, ret);
 
-			clock_gettime(CLOCK_MONOTONIC, &e);
-			poll_time = get_elapsed(&s, &e, MILLI);
+			poll_time = ft_timer_ticks_to_ns(ft_timer_ticks() - s) /
+				    MILLI;
 		} while (ret == -FI_EAGAIN && poll_time < timeout);
 
 		break;
 	case FI_WAIT_UNSPEC:
 	case FI_WAIT_FD:
 	case FI_WAIT_MUTEX_COND:
-		ft_cq_read(fi_cq_sread, cq, buf, comp_entry_cnt[ft_x->cq_format],
+		ft_cq_read(fi_cq_sread, cq, buf, ft_comp_batch(),
 			ft_x->credits, x_str, ret, NULL, timeout);
 		break;
 	case FI_WAIT_SET:
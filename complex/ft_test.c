@@ -347,10 +347,10 @@ static int ft_run_latency(void)
 		if (ret)
 			return ret;
 
-		clock_gettime(CLOCK_MONOTONIC, &start);
+		ft_timer_gettime(&start);
 		ret = (test_info.ep_type == FI_EP_DGRAM) ?
 			ft_pingpong_dgram() : ft_pingpong();
-		clock_gettime(CLOCK_MONOTONIC, &end);
+		ft_timer_gettime(&end);
 		if (ret) {
 			FT_PRINTERR("latency test failed!", ret);
 			return ret;
@@ -472,10 +472,10 @@ static int ft_run_bandwidth(void)
 		if (ret)
 			return ret;
 
-		clock_gettime(CLOCK_MONOTONIC, &start);
+		ft_timer_gettime(&start);
 		ret = (test_info.ep_type == FI_EP_DGRAM) ?
 			ft_bw_dgram(&recv_cnt) : ft_bw();
-		clock_gettime(CLOCK_MONOTONIC, &end);
+		ft_timer_gettime(&end);
 		if (ret) {
 			FT_PRINTERR("bw test failed!", ret);
 			return ret;
@@ -501,6 +501,8 @@ int ft_run_test()
 {
 	int ret;
 
+	ft_timer_init();
+
 	ret = ft_init_control();
 	if (ret) {
 		FT_PRINTERR("ft_init_control", ret);
@@ -89,7 +89,10 @@ enum ft_comp_method {
 	FT_COMP_SPIN = 0,
 	FT_COMP_SREAD,
 	FT_COMP_WAITSET,
-	FT_COMP_WAIT_FD
+	FT_COMP_WAIT_FD,
+	FT_COMP_HYBRID,
+	FT_COMP_POLLSET,
+	FT_COMP_EPOLL
 };
 
 enum {
@@ -103,6 +106,41 @@ enum {
 	FT_OPT_VERIFY_DATA	= 1 << 7,
 	FT_OPT_ALIGN		= 1 << 8,
 	FT_OPT_BW		= 1 << 9,
+	FT_OPT_LAT_HIST		= 1 << 10,
+	FT_OPT_POOL		= 1 << 11,
+	FT_OPT_NUMA		= 1 << 12,
+	FT_OPT_CPU		= 1 << 13,
+	FT_OPT_STREAM		= 1 << 14,
+	FT_OPT_PERF_EVENTS	= 1 << 15,
+	FT_OPT_RESIDENCY	= 1 << 16,
+	FT_OPT_SELECTIVE	= 1 << 17,
+};
+
+/* Backing memory for the buffers allocated by ft_alloc_msgs() */
+enum ft_mem_type {
+	FT_MEM_DEFAULT = 0,
+	FT_MEM_HUGETLB,
+	FT_MEM_THP,
+};
+
+/* Output formats for benchmark result records, see ft_perf_write(). */
+enum ft_perf_fmt {
+	FT_PERF_TEXT = 0,
+	FT_PERF_YAML,
+	FT_PERF_JSON,
+	FT_PERF_CSV,
+	FT_PERF_FMT_CNT
+};
+
+/*
+ * How -v data is produced and checked: a pattern filled and compared in
+ * full, or (-V) a sequence number and CRC32C stamped in the first bytes of
+ * each message, checked inline or on a verifier thread.
+ */
+enum ft_verify_mode {
+	FT_VERIFY_PATTERN = 0,
+	FT_VERIFY_CSUM,
+	FT_VERIFY_CSUM_THREAD
 };
 
 /* for RMA tests --- we want to be able to select fi_writedata, but there is no
@@ -127,35 +165,101 @@ struct ft_opts {
 	int options;
 	enum ft_comp_method comp_method;
 	int machr;
+	enum ft_perf_fmt perf_fmt;
+	enum ft_verify_mode verify_mode;
+	enum ft_mem_type mem_type;
+	int numa_node;
 	enum ft_rma_opcodes rma_op;
+	int comp_batch;
+	int spin_usec;
 	int argc;
 	char **argv;
 };
 
 extern struct fi_info *fi_pep, *fi, *hints;
 extern struct fid_fabric *fabric;
-extern struct fid_wait *waitset;
 extern struct fid_domain *domain;
-extern struct fid_poll *pollset;
 extern struct fid_pep *pep;
 extern struct fid_ep *ep, *alias_ep;
-extern struct fid_cq *txcq, *rxcq;
-extern struct fid_cntr *txcntr, *rxcntr;
 extern struct fid_mr *mr, no_mr;
 extern struct fid_av *av;
 extern struct fid_eq *eq;
 
-extern fi_addr_t remote_fi_addr;
-extern char *buf, *tx_buf, *rx_buf;
-extern size_t buf_size, tx_size, rx_size;
-extern int tx_fd, rx_fd;
+/*
+ * Data path state of one endpoint.  The ft_ctx_* calls work on any number
+ * of these, e.g. one per thread.  The classic calls run on ft_default_ctx,
+ * whose fields are the classic globals below; only ep, mr and the
+ * completion method are set on each call.
+ */
+struct ft_ctx {
+	struct fid_ep *ep;
+	struct fid_cq *tx_cq, *rx_cq;
+	struct fid_cntr *tx_cntr, *rx_cntr;
+	struct fid_mr *mr;
+	int comp_method;
+	int tx_wait_fd, rx_wait_fd;
+	struct fid_wait *wait_set;
+	struct fid_poll *poll_set;
+	int epoll_fd;
+	char *buf, *tx_msg, *rx_msg;
+	size_t rx_msg_size;
+	fi_addr_t peer_addr;
+	uint64_t tx_posted, rx_posted, tx_completed, rx_completed;
+	struct fi_context tx_ctx, rx_ctx;
+};
+
+extern struct ft_ctx ft_default_ctx;
+
+#define txcq		ft_default_ctx.tx_cq
+#define rxcq		ft_default_ctx.rx_cq
+#define txcntr		ft_default_ctx.tx_cntr
+#define rxcntr		ft_default_ctx.rx_cntr
+#define tx_fd		ft_default_ctx.tx_wait_fd
+#define rx_fd		ft_default_ctx.rx_wait_fd
+#define waitset		ft_default_ctx.wait_set
+#define pollset		ft_default_ctx.poll_set
+#define tx_buf		ft_default_ctx.tx_msg
+#define rx_buf		ft_default_ctx.rx_msg
+#define rx_size		ft_default_ctx.rx_msg_size
+#define remote_fi_addr	ft_default_ctx.peer_addr
+#define tx_seq		ft_default_ctx.tx_posted
+#define rx_seq		ft_default_ctx.rx_posted
+#define tx_cq_cntr	ft_default_ctx.tx_completed
+#define rx_cq_cntr	ft_default_ctx.rx_completed
+
+extern char *buf;
+extern size_t buf_size, tx_size;
 extern int timeout;
 
+/* Busy-poll loops only check the timeout once every this many polls */
+#define FT_TIMEOUT_POLLS	1024
+
 extern struct fi_context tx_ctx, rx_ctx;
+
+/*
+ * Per-window buffer slots (FT_OPT_POOL).  ft_alloc_msgs() carves slot_cnt
+ * transmit and receive slots out of the same registered region as tx_buf
+ * and rx_buf, so fi_mr_desc(mr) covers every slot.  Without a pool, all
+ * slots alias tx_buf/rx_buf.
+ */
+struct ft_pool {
+	size_t slot_size;
+	int slot_cnt;
+	char *tx_base;
+	char *rx_base;
+};
+extern struct ft_pool ft_pool;
+
+/*
+ * CPU pinning (-C).  Thread idx runs on entry idx of the cpu list, wrapping
+ * around; the main thread is pinned to entry 0 while options are parsed.
+ */
+int ft_parse_cpu_list(const char *str);
+int ft_pin_thread(int idx);
+void ft_get_cpu(int *cpu, int *node);
 extern struct fi_context *tx_ctx_arr, *rx_ctx_arr;
 extern uint64_t remote_cq_data;
 
-extern uint64_t tx_seq, rx_seq, tx_cq_cntr, rx_cq_cntr;
 extern struct fi_av_attr av_attr;
 extern struct fi_eq_attr eq_attr;
 extern struct fi_cq_attr cq_attr;
@@ -165,6 +269,140 @@ extern char test_name[50];
 extern struct timespec start, end;
 extern struct ft_opts opts;
 
+static inline void *ft_tx_slot(int i)
+{
+	return ft_pool.slot_cnt ? ft_pool.tx_base + i * ft_pool.slot_size :
+				  tx_buf;
+}
+
+static inline void *ft_rx_slot(int i)
+{
+	return ft_pool.slot_cnt ? ft_pool.rx_base + i * ft_pool.slot_size :
+				  rx_buf;
+}
+
+/*
+ * Maximum number of CQ entries reaped by a single fi_cq_read/sread call.
+ * Completions are read into a stack array of fi_cq_err_entry, which is large
+ * enough to hold any CQ format.
+ */
+#define FT_COMP_BATCH_DEFAULT	16
+#define FT_COMP_BATCH_MAX	64
+
+/*
+ * FT_COMP_HYBRID busy-polls a CQ for up to opts.spin_usec after the last
+ * completion, then blocks on the CQ's fd.  Completions read while spinning
+ * and after a wakeup are counted separately from ft_start() on.
+ */
+#define FT_SPIN_USEC_DEFAULT	50
+
+struct ft_comp_stats {
+	uint64_t spin;
+	uint64_t wakeup;
+};
+
+extern struct ft_comp_stats ft_comp_stats;
+
+/*
+ * Time spent generating and checking -v patterns or -V checksums from
+ * ft_start() on, in timer ticks, and the bytes covered.  A -V verifier
+ * thread's checks are not included.
+ */
+struct ft_verify_stats {
+	uint64_t ticks;
+	uint64_t bytes;
+};
+
+extern struct ft_verify_stats ft_verify_stats;
+
+/* Bumped by ft_start(), invalidates the -V payload checksums cached since */
+extern unsigned int ft_csum_gen;
+
+/*
+ * Resources used between ft_start() and ft_stop(): process CPU time and
+ * context switches from getrusage(), and with -E the hardware counters of
+ * the calling thread.  A counter that could not be opened reads as -1.
+ */
+enum {
+	FT_PERF_EV_CYCLES,
+	FT_PERF_EV_INSTR,
+	FT_PERF_EV_CACHE_MISS,
+	FT_PERF_EV_ITLB_MISS,
+	FT_PERF_EV_CNT
+};
+
+struct ft_rusage {
+	int valid;
+	int64_t wall_usec;
+	uint64_t utime_usec;
+	uint64_t stime_usec;
+	long nvcsw;
+	long nivcsw;
+	int64_t events[FT_PERF_EV_CNT];
+};
+
+extern struct ft_rusage ft_rusage;
+
+void ft_rusage_start(void);
+void ft_rusage_stop(void);
+
+static inline int ft_comp_batch(void)
+{
+	if (opts.comp_batch <= 0)
+		return 1;
+	return opts.comp_batch < FT_COMP_BATCH_MAX ?
+		opts.comp_batch : FT_COMP_BATCH_MAX;
+}
+
+/*
+ * Log-linear (HDR-style) histogram of nanosecond samples.  Each power of two
+ * is split into FT_HIST_SUB_CNT linear buckets, which bounds the relative
+ * error of a reported value to 1 / FT_HIST_SUB_CNT.  Storage is preallocated,
+ * so ft_hist_add() may be called from timed loops.
+ */
+#define FT_HIST_SUB_BITS	6
+#define FT_HIST_SUB_CNT		(1 << FT_HIST_SUB_BITS)
+#define FT_HIST_BUCKETS		((64 - FT_HIST_SUB_BITS + 1) * FT_HIST_SUB_CNT)
+
+struct ft_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t last;
+	double sum;
+	double delta_sum;
+	uint64_t bucket[FT_HIST_BUCKETS];
+};
+
+extern struct ft_hist lat_hist;
+
+/*
+ * Per-operation contexts for the bandwidth tests (-R and -Q).  Each carries
+ * the post time in timer ticks and is marked done when its completion is
+ * read from a CQ, so that a slot is only reused once its own operation has
+ * completed.  With -R, completions read from ft_start() on also add the
+ * time since the post to res_hist.  reaped counts the completions of pool
+ * contexts.
+ */
+struct ft_op_ctx {
+	struct fi_context ctx;
+	uint64_t post_tick;
+	int done;
+};
+
+struct ft_op_pool {
+	struct ft_op_ctx *op;
+	int cnt;
+	size_t entry_size;
+	uint64_t reaped;
+};
+
+extern struct ft_op_pool ft_op_pool;
+extern struct ft_hist res_hist;
+
+int ft_op_pool_alloc(int cnt);
+void ft_op_reap(const void *comp, int cnt);
+
 void ft_parseinfo(int op, char *optarg, struct fi_info *hints);
 void ft_parse_addr_opts(int op, char *optarg, struct ft_opts *opts);
 void ft_parsecsopts(int op, char *optarg, struct ft_opts *opts);
@@ -185,11 +423,12 @@ void ft_sock_shutdown(int fd);
 extern int ft_skip_mr;
 extern int ft_parent_proc;
 extern int ft_socket_pair[2];
+extern int ft_child_id;
 extern int sock;
 extern int listen_sock;
 #define ADDR_OPTS "B:P:s:a:"
 #define INFO_OPTS "d:p:e:"
-#define CS_OPTS ADDR_OPTS "I:S:mc:t:w:l"
+#define CS_OPTS ADDR_OPTS "I:S:mc:t:w:lO:M:N:C:E"
 
 extern char default_port[8];
 
@@ -201,6 +440,8 @@ extern char default_port[8];
 		.window_size = 64, \
 		.sizes_enabled = FT_DEFAULT_SIZE, \
 		.rma_op = FT_RMA_WRITE, \
+		.comp_batch = FT_COMP_BATCH_DEFAULT, \
+		.spin_usec = FT_SPIN_USEC_DEFAULT, \
 		.argc = argc, .argv = argv \
 	}
 
@@ -298,36 +539,185 @@ int ft_exchange_keys(struct fi_rma_iov *peer_iov);
 void ft_free_res();
 void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len);
 
+/*
+ * Timer layer.  An invariant TSC is used as the time source when the CPU
+ * provides one; otherwise ticks are CLOCK_MONOTONIC nanoseconds.  Tick
+ * values are only meaningful relative to each other and are converted to
+ * nanoseconds with ft_timer_ticks_to_ns().  ft_timer_init() calibrates the
+ * TSC and is safe to call more than once.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define FT_HAVE_TSC 1
+#else
+#define FT_HAVE_TSC 0
+#endif
+
+enum ft_timer_src {
+	FT_TIMER_CLOCK,
+	FT_TIMER_TSC,
+};
+
+struct ft_timer {
+	enum ft_timer_src src;
+	int init;
+	double nsec_per_tick;
+	uint64_t base_tick;
+	uint64_t base_nsec;
+};
+
+extern struct ft_timer ft_timer;
+
+void ft_timer_init(void);
+void ft_timer_gettime(struct timespec *ts);
+
+static inline uint64_t ft_clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#if FT_HAVE_TSC
+static inline uint64_t ft_rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+#endif
+
+static inline uint64_t ft_timer_ticks(void)
+{
+#if FT_HAVE_TSC
+	if (ft_timer.src == FT_TIMER_TSC)
+		return ft_rdtsc();
+#endif
+	return ft_clock_ns();
+}
+
+static inline uint64_t ft_timer_ticks_to_ns(uint64_t ticks)
+{
+	return (uint64_t) (ticks * ft_timer.nsec_per_tick);
+}
+
+/* Monotonic nanoseconds on the same timeline as CLOCK_MONOTONIC */
+static inline uint64_t ft_gettime_ns(void)
+{
+	return ft_timer.base_nsec +
+	       ft_timer_ticks_to_ns(ft_timer_ticks() - ft_timer.base_tick);
+}
+
 static inline void ft_start(void)
 {
 	opts.options |= FT_OPT_ACTIVE;
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	ft_comp_stats.spin = ft_comp_stats.wakeup = 0;
+	ft_verify_stats.ticks = ft_verify_stats.bytes = 0;
+	ft_csum_gen++;
+	ft_rusage_start();
+	ft_timer_init();
+	ft_timer_gettime(&start);
 }
 static inline void ft_stop(void)
 {
-	clock_gettime(CLOCK_MONOTONIC, &end);
+	ft_timer_gettime(&end);
+	ft_rusage_stop();
 	opts.options &= ~FT_OPT_ACTIVE;
 }
+
+static inline int ft_hist_index(uint64_t val)
+{
+	int shift;
+
+	if (val < FT_HIST_SUB_CNT)
+		return (int) val;
+
+	shift = 63 - __builtin_clzll(val) - FT_HIST_SUB_BITS;
+	return ((shift + 1) << FT_HIST_SUB_BITS) +
+		(int) ((val >> shift) - FT_HIST_SUB_CNT);
+}
+
+static inline void ft_hist_add(struct ft_hist *hist, uint64_t val)
+{
+	hist->bucket[ft_hist_index(val)]++;
+	if (hist->count++)
+		hist->delta_sum += val > hist->last ?
+				   val - hist->last : hist->last - val;
+	hist->last = val;
+	hist->sum += val;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+void ft_hist_reset(struct ft_hist *hist);
+uint64_t ft_hist_percentile(const struct ft_hist *hist, double pct);
+double ft_hist_jitter(const struct ft_hist *hist);
+void ft_hist_merge(struct ft_hist *dst, const struct ft_hist *src);
+
 int ft_sync();
 int ft_sync_pair(int status);
 int ft_fork_and_pair();
+int ft_fork_children(int cnt);
 int ft_wait_child();
 int ft_finalize(void);
 
 size_t ft_rx_prefix_size();
 size_t ft_tx_prefix_size();
 ssize_t ft_post_rx(struct fid_ep *ep, size_t size, struct fi_context* ctx);
+ssize_t ft_post_rx_buf(struct fid_ep *ep, size_t size, struct fi_context* ctx,
+		void *buf);
 ssize_t ft_post_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size,
 		struct fi_context* ctx);
+ssize_t ft_post_tx_buf(struct fid_ep *ep, fi_addr_t fi_addr, size_t size,
+		struct fi_context* ctx, void *buf);
+ssize_t ft_post_inject_buf(struct fid_ep *ep, size_t size, void *buf);
 ssize_t ft_rx(struct fid_ep *ep, size_t size);
 ssize_t ft_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context *ctx);
 ssize_t ft_inject(struct fid_ep *ep, size_t size);
+
+int ft_ctx_open(struct ft_ctx *c, struct fi_info *info, struct fid_av *av,
+		size_t size);
+/* The context the classic calls run on, for ep */
+static inline struct ft_ctx *ft_ctx_default(struct fid_ep *ep)
+{
+	ft_default_ctx.ep = ep;
+	ft_default_ctx.mr = mr;
+	ft_default_ctx.comp_method = opts.comp_method;
+	return &ft_default_ctx;
+}
+void ft_ctx_close(struct ft_ctx *c);
+ssize_t ft_ctx_post_rx_buf(struct ft_ctx *c, size_t size,
+		struct fi_context *ctx, void *buf);
+ssize_t ft_ctx_post_rx(struct ft_ctx *c, size_t size, struct fi_context *ctx);
+ssize_t ft_ctx_post_tx_buf(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx, void *buf);
+ssize_t ft_ctx_post_tx(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx);
+ssize_t ft_ctx_post_inject_buf(struct ft_ctx *c, size_t size, void *buf);
+ssize_t ft_ctx_rx(struct ft_ctx *c, size_t size);
+ssize_t ft_ctx_tx(struct ft_ctx *c, fi_addr_t fi_addr, size_t size,
+		struct fi_context *ctx);
+ssize_t ft_ctx_inject(struct ft_ctx *c, size_t size);
+int ft_ctx_get_rx_comp(struct ft_ctx *c, uint64_t total);
+int ft_ctx_get_tx_comp(struct ft_ctx *c, uint64_t total);
 ssize_t ft_post_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 		struct fi_rma_iov *remote, void *context);
+ssize_t ft_post_rma_buf(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
+		struct fi_rma_iov *remote, void *context, void *buf);
 ssize_t ft_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 		struct fi_rma_iov *remote, void *context);
+ssize_t ft_post_tx_flags(struct fid_ep *ep, fi_addr_t fi_addr, size_t size,
+		void *context, void *buf, uint64_t flags);
+ssize_t ft_post_rma_flags(enum ft_rma_opcodes op, struct fid_ep *ep,
+		size_t size, struct fi_rma_iov *remote, void *context,
+		void *buf, uint64_t flags);
 ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 		struct fi_rma_iov *remote);
+ssize_t ft_post_rma_inject_buf(enum ft_rma_opcodes op, struct fid_ep *ep,
+		size_t size, struct fi_rma_iov *remote, void *buf);
 
 int ft_cq_readerr(struct fid_cq *cq);
 int ft_get_rx_comp(uint64_t total);
@@ -337,6 +727,66 @@ void eq_readerr(struct fid_eq *eq, const char *eq_str);
 
 int64_t get_elapsed(const struct timespec *b, const struct timespec *a,
 		enum precision p);
+
+enum {
+	FT_PERF_LAT_MIN,
+	FT_PERF_LAT_P50,
+	FT_PERF_LAT_P90,
+	FT_PERF_LAT_P99,
+	FT_PERF_LAT_P999,
+	FT_PERF_LAT_MAX,
+	FT_PERF_LAT_JITTER,
+	FT_PERF_LAT_CNT
+};
+
+/*
+ * One benchmark result.  ft_perf_init_rec() fills in the run configuration
+ * from fi/opts and derives the rates from the measured interval; callers
+ * may then adjust fields before handing the record to ft_perf_write().
+ */
+struct ft_perf_rec {
+	const char *name;
+	const char *prov_name;
+	const char *ep_type;
+	const char *comp_method;
+	int window_size;
+	int xfer_size;
+	int iterations;
+	int xfers_per_iter;
+	long long bytes;
+	int64_t elapsed_usec;
+	double mbps;
+	double usec_per_xfer;
+	double mxfers_per_sec;
+	int lat_valid;
+	double lat_usec[FT_PERF_LAT_CNT];
+	int res_valid;
+	double res_usec[FT_PERF_LAT_CNT];
+	const char *mem_type;
+	int mem_node;
+	int cpu;
+	int cpu_node;
+	uint64_t comp_spin;
+	uint64_t comp_wakeup;
+	int usage_valid;
+	double cpu_pct;
+	uint64_t utime_usec;
+	uint64_t stime_usec;
+	long nvcsw;
+	long nivcsw;
+	int64_t events[FT_PERF_EV_CNT];
+	double cycles_per_xfer;
+	double instr_per_xfer;
+	double verify_ms_per_gb;
+	double verify_pct;
+	int argc;
+	char **argv;
+};
+
+void ft_perf_init_rec(struct ft_perf_rec *rec, char *name, int tsize,
+		int iters, struct timespec *start, struct timespec *end,
+		int xfers_per_iter);
+void ft_perf_write(enum ft_perf_fmt fmt, const struct ft_perf_rec *rec);
 void show_perf(char *name, int tsize, int iters, struct timespec *start,
 		struct timespec *end, int xfers_per_iter);
 void show_perf_mr(int tsize, int iters, struct timespec *start,
@@ -46,6 +46,7 @@
 #include <dlfcn.h>
 
 #include "pmi.h"
+#include "shared.h"
 #include "ft_utils.h"
 
 #ifndef CRAY_PMI_COLL
@@ -280,6 +281,10 @@ void FT_Init(int *argc, char ***argv)
 	assert(rc == PMI_SUCCESS);
 
 	pmi_coll_init();
+
+	/* calibrate the timer used by get_time_usec() before any threads
+	 * start taking timestamps */
+	ft_timer_init();
 }
 
 void FT_Rank(int *rank)
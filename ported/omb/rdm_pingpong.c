@@ -127,6 +127,7 @@ void print_usage(void)
 
 	FT_PRINT_OPTS_USAGE("-l <loops>", "number of loops to measure");
 	FT_PRINT_OPTS_USAGE("-s <skip>", "number of loops to skip");
+	FT_PRINT_OPTS_USAGE("-C <cpu-list>", "pin threads to cpus, e.g. 0,2,4-7");
 }
 
 static void cq_readerr(struct fid_cq *cq, const char *cq_str)
@@ -434,6 +435,9 @@ void *thread_fn(void *data)
 
 	ptd = &thread_data[it.thread_id];
 
+	/* A pinning failure is reported; keep running so the peer can finish */
+	ft_pin_thread(it.thread_id);
+
 #ifdef THREAD_SYNC
 	if (!it.thread_id)
 		FT_Barrier();
@@ -504,7 +508,7 @@ int main(int argc, char *argv[])
 	if (!hints)
 		return -1;
 
-	while ((op = getopt(argc, argv, "hl:ms:t:" INFO_OPTS)) != -1) {
+	while ((op = getopt(argc, argv, "hl:ms:t:C:" INFO_OPTS)) != -1) {
 		switch (op) {
 		default:
 			ft_parseinfo(op, optarg, hints);
@@ -541,6 +545,13 @@ int main(int argc, char *argv[])
                                 return EXIT_FAILURE;
                         }
                         break;
+		case 'C':
+			if (ft_parse_cpu_list(optarg) <= 0 ||
+			    ft_pin_thread(0) < 0) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?':
 		case 'h':
 			print_usage();
@@ -146,6 +146,7 @@ void print_usage(void)
 		FT_PRINT_OPTS_USAGE("-l <loops>", "number of loops to measure");
 		FT_PRINT_OPTS_USAGE("-s <skip>", "number of loops to skip");
 		FT_PRINT_OPTS_USAGE("-i <iterations>", "iterations per loop");
+		FT_PRINT_OPTS_USAGE("-C <cpu-list>", "pin threads to cpus, e.g. 0,2,4-7");
 	}
 }
 
@@ -472,6 +473,9 @@ void *thread_fn(void *data)
 		return (void *)-EINVAL;
 
 	ptd = &thread_data[it.thread_id];
+
+	/* A pinning failure is reported; keep running so the peer can finish */
+	ft_pin_thread(it.thread_id);
 	ptd->bytes_sent = 0;
 
         tbarrier(&ptd->tbar);
@@ -558,7 +562,7 @@ int main(int argc, char *argv[])
 	if (!hints)
 		return -1;
 
-	while ((op = getopt(argc, argv, "hmt:i:l:s:" INFO_OPTS)) != -1) {
+	while ((op = getopt(argc, argv, "hmt:i:l:s:C:" INFO_OPTS)) != -1) {
 		switch (op) {
 		default:
 			ft_parseinfo(op, optarg, hints);
@@ -604,6 +608,13 @@ int main(int argc, char *argv[])
 			}
 			window_size_large = window_size;
 			break;
+		case 'C':
+			if (ft_parse_cpu_list(optarg) <= 0 ||
+			    ft_pin_thread(0) < 0) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?':
 		case 'h':
 			print_usage();
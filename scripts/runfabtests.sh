@@ -110,6 +110,14 @@ short_tests=(
 	"rma_bw -e rdm -o write -I 5"
 	"rma_bw -e rdm -o read -I 5"
 	"rma_bw -e rdm -o writedata -I 5"
+	"rma_pingpong -e rdm -o inject_write -I 5"
+	"rma_pingpong -e rdm -o write -I 5"
+	"rma_pingpong -e rdm -o writedata -I 5"
+	"rdm_atomic_perf -o all -I 5"
+	"rdm_incast -n 4 -I 5"
+	"rdm_incast -n 4 -F -I 5"
+	"rdm_wakeup -I 5"
+	"rdm_tagged_match -S 64 -I 5"
 	"msg_rma -o write -I 5"
 	"msg_rma -o read -I 5"
 	"msg_rma -o writedata -I 5"
@@ -123,6 +131,8 @@ short_tests=(
 	"rdm_rma -o writedata -I 5"
 	"rdm_tagged_pingpong -I 5"
 	"rdm_tagged_bw -I 5"
+	"rdm_mt_bw -I 5 -n 2"
+	"rdm_load -I 5"
 	"dgram_pingpong -I 5"
 	"rc_pingpong -n 5"
 	"rc_pingpong -n 5 -e"
@@ -140,6 +150,17 @@ standard_tests=(
 	"rma_bw -e rdm -o write"
 	"rma_bw -e rdm -o read"
 	"rma_bw -e rdm -o writedata"
+	"rma_pingpong -e msg -o write"
+	"rma_pingpong -e rdm -o inject_write"
+	"rma_pingpong -e rdm -o write"
+	"rma_pingpong -e rdm -o writedata"
+	"rdm_atomic_perf -o sum -n all"
+	"rdm_incast -n 8"
+	"rdm_incast -n 8 -F"
+	"rdm_wakeup"
+	"rdm_tagged_match -S 64"
+	"rdm_tagged_match -S 64 -g all"
+	"rdm_tagged_match -S 64 -U"
 	"msg_rma -o write"
 	"msg_rma -o read"
 	"msg_rma -o writedata"
@@ -156,6 +177,8 @@ standard_tests=(
 	"rdm_rma -o writedata"
 	"rdm_tagged_pingpong"
 	"rdm_tagged_bw"
+	"rdm_mt_bw -n 4"
+	"rdm_load -r 10000:100000:30000"
 	"dgram_pingpong"
 	"dgram_pingpong -v"
 	"dgram_pingpong -k"
@@ -73,7 +73,7 @@ av_test_sync(enum fi_av_type type, int count, uint64_t flags)
 	uint8_t *cptr;
 	void *local_name_addr = NULL, *remote_name_addr = NULL;
 	void *test_name_addr = NULL;
-	static fi_addr_t *fi_addr_vec, remote_fi_addr;
+	static fi_addr_t *fi_addr_vec, peer_fi_addr;
 	size_t addrlen = 0,test_addrlen = 0;
 
 	memset(&attr, 0, sizeof(attr));
@@ -122,7 +122,7 @@ av_test_sync(enum fi_av_type type, int count, uint64_t flags)
 	 * let's insert one entry first
 	 */
 
-	ret = fi_av_insert(av, remote_name_addr, 1, &remote_fi_addr,
+	ret = fi_av_insert(av, remote_name_addr, 1, &peer_fi_addr,
 				0, NULL);
 	if (ret != 1) {
 		fprintf(stderr,"fi_av_insert %d: %s\n", ret, fi_strerror(-ret));
@@ -133,7 +133,7 @@ av_test_sync(enum fi_av_type type, int count, uint64_t flags)
 	 * lets try to read it back
 	 */
 
-	ret = fi_av_lookup(av, remote_fi_addr, test_name_addr, &test_addrlen);
+	ret = fi_av_lookup(av, peer_fi_addr, test_name_addr, &test_addrlen);
 	if (ret != -FI_ETOOSMALL) {
 		fprintf(stderr,"fi_av_lookup %d: %s\n", ret, fi_strerror(-ret));
 		goto err;
@@ -142,7 +142,7 @@ av_test_sync(enum fi_av_type type, int count, uint64_t flags)
 	test_name_addr = malloc(test_addrlen);
 	assert(test_name_addr != NULL);
 
-	ret = fi_av_lookup(av, remote_fi_addr, test_name_addr, &test_addrlen);
+	ret = fi_av_lookup(av, peer_fi_addr, test_name_addr, &test_addrlen);
 	if (ret != FI_SUCCESS) {
 		fprintf(stderr,"fi_av_lookup %d: %s\n", ret, fi_strerror(-ret));
 		goto err;
@@ -154,7 +154,7 @@ av_test_sync(enum fi_av_type type, int count, uint64_t flags)
 		goto err;
 	}
 
-	ret = fi_av_remove(av, &remote_fi_addr, 1, 0);
+	ret = fi_av_remove(av, &peer_fi_addr, 1, 0);
 	if (ret != FI_SUCCESS) {
 		fprintf(stderr,"fi_av_remove %d: %s\n", ret, fi_strerror(-ret));
 		goto err;